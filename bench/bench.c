@@ -0,0 +1,687 @@
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define BENCH_DEFAULT_PORT "18081"
+#define BENCH_DEFAULT_CLIENT "bin/tcp_client"
+#define BENCH_DEFAULT_SERVER "bin/tcp_server"
+#define BENCH_SERVER_START_TIMEOUT 2000
+#define BENCH_READ_SIZE 65536
+#define BENCH_MAX_CLIENT_ARGS 16
+#define BENCH_OUTPUT_INTERVAL "50"
+#define BENCH_OUTPUT_INTERVAL_TIMEOUT 1000
+#define ALL_OPTIONS_PARSED -1
+#define SHORT_OPTIONS "vp:c:s:r:"
+#define HELP_MESSAGE "\n\
+    Usage: tcp_bench [--help] [-v] [-p PORT] [-c CLIENT] [-s SERVER] [-r N]\n\
+    \n\
+    Starts SERVER on PORT over loopback, feeds CLIENT generated requests\n\
+    through a pipe for every scenario and prints one JSON object per\n\
+    scenario: requests/sec, MB/s and p50/p99/p999 latency in microseconds.\n\
+    A request's latency runs from the moment its last byte is written to\n\
+    the client until its response comes out of the client.\n\
+    \n\
+    First, for every way the client can run a connection, it checks that\n\
+    a lone response comes out within --output-interval while the client's\n\
+    input stays open with nothing more to send.\n\
+    \n\
+    Options:\n\
+    --help\n\
+    -v, --verbose\n\
+    --port PORT, -p PORT       (default 18081)\n\
+    --client PATH, -c PATH     (default bin/tcp_client)\n\
+    --server PATH, -s PATH     (default bin/tcp_server)\n\
+    --repeat N, -r N           Run every scenario N times (default 1)\n"
+
+/*
+One benchmark run: lines requests of message_size bytes each, with at most window requests
+awaiting a response (0 for no limit).
+*/
+typedef struct Scenario {
+    const char *name;
+    size_t message_size;
+    size_t lines;
+    int window;
+} Scenario;
+
+/*
+What the benchmark was asked to do on the command line.
+*/
+typedef struct BenchConfig {
+    char *port;
+    char *client;
+    char *server;
+    int repeat;
+} BenchConfig;
+
+/*
+Generated input for a scenario. line_ends[i] is the offset just past request i.
+*/
+typedef struct Input {
+    char *data;
+    size_t size;
+    size_t *line_ends;
+    size_t lines;
+} Input;
+
+/*
+Measurements of one run. latencies[i] is request i's latency in nanoseconds.
+*/
+typedef struct Result {
+    uint64_t *latencies;
+    size_t responses;
+    size_t bytes_received;
+    uint64_t elapsed;
+} Result;
+
+static const Scenario SCENARIOS[] = {
+    {"tiny", 16, 200000, 0},
+    {"tiny_window_16", 16, 200000, 16},
+    {"small", 256, 100000, 0},
+    {"small_window_1", 256, 20000, 1},
+    {"medium", 4096, 20000, 0},
+    {"medium_window_64", 4096, 20000, 64},
+    {"large", 65536, 1000, 0},
+    {"huge", 1048576, 64, 0},
+};
+
+static const char *ACTIONS[] = {"uppercase", "lowercase", "reverse", "shuffle", "random"};
+
+// client options for every loop that has to flush output on its own, NULL terminated
+static char *INTERVAL_MODES[][3] = {
+    {"-d", NULL},
+    {"-d", "-s", NULL},
+    {"-d", "-u", NULL},
+    {"-c", "2", NULL},
+};
+
+/*
+Description:
+    Reads the monotonic clock.
+Arguments:
+    None
+Return value:
+    Returns the time in nanoseconds
+*/
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+Description:
+    Checks if a string is a non-empty run of digits.
+Arguments:
+    char *string: The string to check
+Return value:
+    Returns a true value if the string is a number, otherwise false
+*/
+static int is_number(char *string) {
+    if (*string == '\0') return false;
+    for (size_t i = 0; string[i] != '\0'; i++) {
+        if (!isdigit((unsigned char)string[i])) return false;
+    }
+    return true;
+}
+
+/*
+Description:
+    Parses the commandline arguments and options given to the benchmark.
+Arguments:
+    int argc: the amount of arguments provided to the program (provided by the main function)
+    char *argv[]: the array of arguments provided to the program (provided by the main function)
+    BenchConfig *config: An empty BenchConfig struct that will be filled in by this function.
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int parse_arguments(int argc, char *argv[], BenchConfig *config) {
+
+    config->port = BENCH_DEFAULT_PORT;
+    config->client = BENCH_DEFAULT_CLIENT;
+    config->server = BENCH_DEFAULT_SERVER;
+    config->repeat = 1;
+
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 0},
+        {"verbose", no_argument, 0, 'v'},
+        {"port", required_argument, 0, 'p'},
+        {"client", required_argument, 0, 'c'},
+        {"server", required_argument, 0, 's'},
+        {"repeat", required_argument, 0, 'r'},
+        {0, 0, 0, 0}
+    };
+
+    while (1) {
+        int option_index = 0;
+        int getopt_return_value = getopt_long(argc, argv, SHORT_OPTIONS, long_options,
+                                              &option_index);
+
+        // exit loop if all arguments are parsed
+        if (getopt_return_value == ALL_OPTIONS_PARSED) break;
+
+        switch (getopt_return_value) {
+        case 0:
+            printf(HELP_MESSAGE);
+            exit(EXIT_SUCCESS);
+
+        case 'v':
+            log_set_level(LOG_TRACE);
+            break;
+
+        case 'p':
+            if (!is_number(optarg)) {
+                log_error("'%s' is not a valid port\n", optarg);
+                return EXIT_FAILURE;
+            }
+            config->port = optarg;
+            break;
+
+        case 'c':
+            config->client = optarg;
+            break;
+
+        case 's':
+            config->server = optarg;
+            break;
+
+        case 'r':
+            if (!is_number(optarg) || atoi(optarg) == 0) {
+                log_error("'%s' is not a valid repeat count\n", optarg);
+                return EXIT_FAILURE;
+            }
+            config->repeat = atoi(optarg);
+            break;
+
+        default:
+            printf(HELP_MESSAGE);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Generates a scenario's requests in the client's input format, "ACTION MESSAGE" per line,
+    cycling through every action. Messages are letters only, so every response is one line.
+Arguments:
+    const Scenario *scenario: What to generate
+    Input *input: Filled in with the generated requests
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int generate_input(const Scenario *scenario, Input *input) {
+
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    size_t action_count = sizeof(ACTIONS) / sizeof(ACTIONS[0]);
+    unsigned long random_state = 88172645463325252UL;
+
+    input->lines = scenario->lines;
+    input->size = 0;
+    input->data = malloc(scenario->lines * (scenario->message_size + 11));
+    input->line_ends = malloc(sizeof(size_t) * scenario->lines);
+    if (input->data == NULL || input->line_ends == NULL) {
+        log_error("Failed to allocate input\n");
+        free(input->data);
+        free(input->line_ends);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t line = 0; line < scenario->lines; line++) {
+        const char *action = ACTIONS[line % action_count];
+        size_t action_length = strlen(action);
+        memcpy(input->data + input->size, action, action_length);
+        input->size += action_length;
+        input->data[input->size++] = ' ';
+        for (size_t i = 0; i < scenario->message_size; i++) {
+            random_state ^= random_state << 13;
+            random_state ^= random_state >> 7;
+            random_state ^= random_state << 17;
+            input->data[input->size++] = letters[random_state % (sizeof(letters) - 1)];
+        }
+        input->data[input->size++] = '\n';
+        input->line_ends[line] = input->size;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Starts a program with its stdin and stdout on pipes. Either pipe may be skipped.
+Arguments:
+    char *argv[]: The program and its arguments, NULL terminated
+    int *to_child: Receives the non-blocking write end of the child's stdin, or NULL
+    int *from_child: Receives the non-blocking read end of the child's stdout, or NULL
+Return value:
+    Returns the child's process id, or -1 on failure
+*/
+static pid_t spawn(char *argv[], int *to_child, int *from_child) {
+
+    int stdin_pipe[2] = {-1, -1}, stdout_pipe[2] = {-1, -1};
+
+    if ((to_child != NULL && pipe(stdin_pipe) == -1) ||
+        (from_child != NULL && pipe(stdout_pipe) == -1)) {
+        log_error("Failed to create pipes\n");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        log_error("Failed to fork\n");
+        return -1;
+    }
+
+    if (pid == 0) {
+        if (to_child != NULL) {
+            dup2(stdin_pipe[0], STDIN_FILENO);
+            close(stdin_pipe[0]);
+            close(stdin_pipe[1]);
+        }
+        if (from_child != NULL) {
+            dup2(stdout_pipe[1], STDOUT_FILENO);
+            close(stdout_pipe[0]);
+            close(stdout_pipe[1]);
+        }
+        execv(argv[0], argv);
+        log_error("Failed to run '%s'\n", argv[0]);
+        _exit(EXIT_FAILURE);
+    }
+
+    if (to_child != NULL) {
+        close(stdin_pipe[0]);
+        fcntl(stdin_pipe[1], F_SETFL, O_NONBLOCK);
+        *to_child = stdin_pipe[1];
+    }
+    if (from_child != NULL) {
+        close(stdout_pipe[1]);
+        fcntl(stdout_pipe[0], F_SETFL, O_NONBLOCK);
+        *from_child = stdout_pipe[0];
+    }
+    return pid;
+}
+
+/*
+Description:
+    Waits until something accepts connections on a loopback port.
+Arguments:
+    const char *port: The port
+    int timeout: How long to wait in milliseconds
+Return value:
+    Returns a 1 if nothing is listening in time, 0 on success
+*/
+static int wait_for_server(const char *port, int timeout) {
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(atoi(port));
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (int waited = 0; waited < timeout; waited += 10) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) return EXIT_FAILURE;
+        int connected = connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+        close(fd);
+        if (connected) return EXIT_SUCCESS;
+        poll(NULL, 0, 10);
+    }
+    log_error("Server didn't start listening on port %s\n", port);
+    return EXIT_FAILURE;
+}
+
+/*
+Description:
+    Runs the client once over the scenario's input, writing requests to it and reading responses
+    from it at the same time. Each request is timestamped when the write that finishes it returns
+    and each response when the read that finishes it returns; they are matched in order.
+Arguments:
+    BenchConfig config: Where the client and server are
+    const Scenario *scenario: The scenario being run
+    const Input *input: The requests
+    Result *result: Filled in with the measurements
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int run_client(BenchConfig config, const Scenario *scenario, const Input *input,
+                      Result *result) {
+
+    char window[16];
+    char *argv[BENCH_MAX_CLIENT_ARGS];
+    int argc = 0;
+
+    argv[argc++] = config.client;
+    argv[argc++] = "-d";
+    argv[argc++] = "-i";
+    argv[argc++] = "0";
+    argv[argc++] = "-h";
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = "-p";
+    argv[argc++] = config.port;
+    if (scenario->window > 0) {
+        snprintf(window, sizeof(window), "%d", scenario->window);
+        argv[argc++] = "-w";
+        argv[argc++] = window;
+    }
+    argv[argc++] = "-";
+    argv[argc] = NULL;
+
+    uint64_t *sent = malloc(sizeof(uint64_t) * input->lines);
+    char *buffer = malloc(BENCH_READ_SIZE);
+    result->latencies = malloc(sizeof(uint64_t) * input->lines);
+    result->responses = 0;
+    result->bytes_received = 0;
+    if (sent == NULL || buffer == NULL || result->latencies == NULL) {
+        log_error("Failed to allocate timestamps\n");
+        free(sent);
+        free(buffer);
+        free(result->latencies);
+        return EXIT_FAILURE;
+    }
+
+    int to_client, from_client;
+    uint64_t start = now_ns();
+    pid_t pid = spawn(argv, &to_client, &from_client);
+    if (pid == -1) {
+        free(sent);
+        free(buffer);
+        free(result->latencies);
+        return EXIT_FAILURE;
+    }
+
+    size_t written = 0, lines_sent = 0;
+    int status = EXIT_SUCCESS;
+
+    while (from_client != -1) {
+        struct pollfd pfds[2] = {{from_client, POLLIN, 0}, {to_client, POLLOUT, 0}};
+        int count = to_client != -1 ? 2 : 1;
+
+        if (poll(pfds, count, -1) == -1) {
+            if (errno == EINTR) continue;
+            log_error("Poll failed!\n");
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        if (count == 2 && (pfds[1].revents & (POLLOUT | POLLERR | POLLHUP))) {
+            ssize_t bytes_written = write(to_client, input->data + written, input->size - written);
+            if (bytes_written == -1 && errno != EAGAIN && errno != EINTR) {
+                log_error("Client stopped reading its input\n");
+                status = EXIT_FAILURE;
+                break;
+            }
+            if (bytes_written > 0) {
+                uint64_t now = now_ns();
+                written += bytes_written;
+                while (lines_sent < input->lines && input->line_ends[lines_sent] <= written) {
+                    sent[lines_sent++] = now;
+                }
+            }
+            if (written == input->size) {
+                close(to_client);
+                to_client = -1;
+            }
+        }
+
+        if (pfds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
+            ssize_t bytes_read = read(from_client, buffer, BENCH_READ_SIZE);
+            if (bytes_read == -1 && errno != EAGAIN && errno != EINTR) {
+                log_error("Failed to read client output\n");
+                status = EXIT_FAILURE;
+                break;
+            }
+            if (bytes_read == 0) {
+                close(from_client);
+                from_client = -1;
+            }
+            if (bytes_read > 0) {
+                uint64_t now = now_ns();
+                result->bytes_received += bytes_read;
+                for (char *line = buffer; (line = memchr(line, '\n', buffer + bytes_read - line));
+                     line++) {
+                    if (result->responses < lines_sent) {
+                        result->latencies[result->responses] = now - sent[result->responses];
+                    }
+                    result->responses++;
+                }
+            }
+        }
+    }
+
+    if (to_client != -1) close(to_client);
+    if (from_client != -1) close(from_client);
+
+    int wait_status;
+    waitpid(pid, &wait_status, 0);
+    result->elapsed = now_ns() - start;
+
+    if (status == EXIT_SUCCESS &&
+        (!WIFEXITED(wait_status) || WEXITSTATUS(wait_status) != 0 ||
+         result->responses != input->lines)) {
+        log_error("Client failed on '%s': %zu of %zu responses\n", scenario->name,
+                  result->responses, input->lines);
+        status = EXIT_FAILURE;
+    }
+
+    free(sent);
+    free(buffer);
+    if (status) free(result->latencies);
+    return status;
+}
+
+/*
+Description:
+    Checks that the client writes out a response once it has waited the output interval, even
+    though nothing arrives after it: one request is written, the client's input is left open, and
+    the response has to come out within BENCH_OUTPUT_INTERVAL_TIMEOUT milliseconds. Prints the
+    outcome as one JSON object on its own line.
+Arguments:
+    BenchConfig config: Where the client and server are
+    char *mode[]: The client options that pick the loop to check, NULL terminated
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int check_output_interval(BenchConfig config, char *mode[]) {
+
+    static const char request[] = "uppercase hello\n";
+    static const char expected[] = "HELLO\n";
+    char *argv[BENCH_MAX_CLIENT_ARGS];
+    char output[sizeof(expected)];
+    char mode_name[32] = "";
+    int argc = 0;
+
+    argv[argc++] = config.client;
+    for (int i = 0; mode[i] != NULL; i++) {
+        argv[argc++] = mode[i];
+        snprintf(mode_name + strlen(mode_name), sizeof(mode_name) - strlen(mode_name), "%s%s",
+                 i > 0 ? " " : "", mode[i]);
+    }
+    argv[argc++] = "-i";
+    argv[argc++] = BENCH_OUTPUT_INTERVAL;
+    argv[argc++] = "-h";
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = "-p";
+    argv[argc++] = config.port;
+    argv[argc++] = "-";
+    argv[argc] = NULL;
+
+    int to_client, from_client;
+    pid_t pid = spawn(argv, &to_client, &from_client);
+    if (pid == -1) return EXIT_FAILURE;
+
+    uint64_t start = now_ns();
+    size_t received = 0;
+    int status = EXIT_SUCCESS;
+
+    if (write(to_client, request, sizeof(request) - 1) != sizeof(request) - 1) {
+        log_error("Failed to write to the client\n");
+        status = EXIT_FAILURE;
+    }
+
+    // the input stays open, so only the interval can get the response out
+    while (status == EXIT_SUCCESS && received < sizeof(expected) - 1) {
+        int waited = (now_ns() - start) / 1000000;
+        if (waited >= BENCH_OUTPUT_INTERVAL_TIMEOUT) {
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        struct pollfd pfd = {from_client, POLLIN, 0};
+        if (poll(&pfd, 1, BENCH_OUTPUT_INTERVAL_TIMEOUT - waited) == -1) {
+            if (errno == EINTR) continue;
+            log_error("Poll failed!\n");
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (!(pfd.revents & (POLLIN | POLLERR | POLLHUP))) continue;
+
+        ssize_t bytes_read = read(from_client, output + received, sizeof(expected) - 1 - received);
+        if (bytes_read == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (bytes_read <= 0) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        received += bytes_read;
+    }
+    double milliseconds = (now_ns() - start) / 1e6;
+    if (status == EXIT_SUCCESS && memcmp(output, expected, sizeof(expected) - 1) != 0) {
+        status = EXIT_FAILURE;
+    }
+
+    // ending the input lets the client finish normally
+    close(to_client);
+    while (1) {
+        struct pollfd pfd = {from_client, POLLIN, 0};
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) break;
+        ssize_t bytes_read = read(from_client, output, sizeof(output));
+        if (bytes_read == 0 || (bytes_read == -1 && errno != EAGAIN && errno != EINTR)) break;
+    }
+    close(from_client);
+
+    int wait_status;
+    waitpid(pid, &wait_status, 0);
+    if (!WIFEXITED(wait_status) || WEXITSTATUS(wait_status) != 0) status = EXIT_FAILURE;
+
+    printf("{\"check\":\"output_interval\",\"mode\":\"%s\",\"interval_ms\":%s,"
+           "\"passed\":%s,\"ms\":%.1f}\n",
+           mode_name, BENCH_OUTPUT_INTERVAL, status ? "false" : "true", milliseconds);
+    fflush(stdout);
+    if (status) log_error("Client held a response back past its interval in '%s'\n", mode_name);
+    return status;
+}
+
+/*
+Description:
+    Orders latencies for qsort().
+Arguments:
+    const void *a: A latency
+    const void *b: Another latency
+Return value:
+    Returns a negative, zero or positive value as a is less than, equal to or greater than b
+*/
+static int compare_latencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+Description:
+    Finds a percentile of sorted latencies.
+Arguments:
+    const uint64_t *sorted: The latencies in ascending order
+    size_t count: The number of latencies, at least one
+    double percentile: The percentile, from 0 to 100
+Return value:
+    Returns the latency in microseconds
+*/
+static double percentile_us(const uint64_t *sorted, size_t count, double percentile) {
+    size_t index = (size_t)(percentile / 100.0 * (count - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+/*
+Description:
+    Prints a run's measurements as one JSON object on its own line.
+Arguments:
+    const Scenario *scenario: The scenario that was run
+    const Input *input: Its requests
+    Result *result: Its measurements; latencies are sorted in place
+Return value:
+    None
+*/
+static void report(const Scenario *scenario, const Input *input, Result *result) {
+
+    double seconds = result->elapsed / 1e9;
+    qsort(result->latencies, result->responses, sizeof(uint64_t), &compare_latencies);
+
+    printf("{\"scenario\":\"%s\",\"message_size\":%zu,\"requests\":%zu,\"window\":%d,"
+           "\"seconds\":%.6f,\"requests_per_sec\":%.1f,\"mb_per_sec_sent\":%.2f,"
+           "\"mb_per_sec_received\":%.2f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}\n",
+           scenario->name, scenario->message_size, input->lines, scenario->window, seconds,
+           input->lines / seconds, input->size / seconds / 1e6,
+           result->bytes_received / seconds / 1e6,
+           percentile_us(result->latencies, result->responses, 50),
+           percentile_us(result->latencies, result->responses, 99),
+           percentile_us(result->latencies, result->responses, 99.9));
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+
+    log_set_level(LOG_ERROR);
+
+    BenchConfig config;
+    if (parse_arguments(argc, argv, &config)) exit(EXIT_FAILURE);
+
+    // the client may exit while requests are still being written to it
+    signal(SIGPIPE, SIG_IGN);
+
+    char *server_argv[] = {config.server, "-h", "127.0.0.1", "-p", config.port, NULL};
+    pid_t server = spawn(server_argv, NULL, NULL);
+    if (server == -1 || wait_for_server(config.port, BENCH_SERVER_START_TIMEOUT)) {
+        if (server != -1) kill(server, SIGTERM);
+        exit(EXIT_FAILURE);
+    }
+
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < sizeof(INTERVAL_MODES) / sizeof(INTERVAL_MODES[0]); i++) {
+        if (check_output_interval(config, INTERVAL_MODES[i])) status = EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]) && !status; i++) {
+        Input input;
+        if (generate_input(&SCENARIOS[i], &input)) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        for (int run = 0; run < config.repeat && !status; run++) {
+            Result result;
+            log_info("Running '%s'\n", SCENARIOS[i].name);
+            status = run_client(config, &SCENARIOS[i], &input, &result);
+            if (status) break;
+            report(&SCENARIOS[i], &input, &result);
+            free(result.latencies);
+        }
+        free(input.data);
+        free(input.line_ends);
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    return status;
+}
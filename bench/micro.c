@@ -0,0 +1,468 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "reader.h"
+#include "tcp_client.h"
+
+#define MICRO_STREAM_BYTES 16777216
+#define MICRO_MAX_MESSAGES 200000
+#define MICRO_RECV_SIZE 16384
+
+/*
+How received bytes are cut into the pieces the parser is fed: as recv() typically returns them, one
+byte at a time, at the awkward points inside every response header, or through a real socket.
+*/
+typedef enum Split {
+    SPLIT_RECV,
+    SPLIT_BYTE,
+    SPLIT_HEADER,
+    SPLIT_SOCKETPAIR,
+    NUMBER_OF_SPLITS
+} Split;
+
+/*
+How far requests go once read: just out of the reader, or on into a batch as the client frames them.
+*/
+typedef enum LineReader {
+    LINE_READER_READER,
+    LINE_READER_BATCH,
+    NUMBER_OF_LINE_READERS
+} LineReader;
+
+/*
+Responses in wire format, with the offset of the space after each length so the header split knows
+where to cut.
+*/
+typedef struct Stream {
+    char *data;
+    size_t size;
+    size_t *spaces;
+    size_t messages;
+} Stream;
+
+/*
+What a socketpair writer thread sends.
+*/
+typedef struct Writer {
+    int fd;
+    const Stream *stream;
+} Writer;
+
+static const char *SPLIT_NAMES[NUMBER_OF_SPLITS] = {"recv", "byte", "header", "socketpair"};
+static const char *LINE_READER_NAMES[NUMBER_OF_LINE_READERS] = {"reader", "batch"};
+static const size_t MESSAGE_SIZES[] = {16, 1024, 65536};
+
+static unsigned long allocations = 0;
+
+// every allocation, including the ones libc makes for the client, is counted on its way through
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+/*
+Description:
+    Reads the monotonic clock.
+Arguments:
+    None
+Return value:
+    Returns the time in nanoseconds
+*/
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+Description:
+    Prints one measurement as a JSON object on its own line.
+Arguments:
+    const char *benchmark: What was measured
+    const char *variant: How it was fed
+    size_t message_size: The size of every message
+    size_t messages: The number of messages handled
+    uint64_t elapsed: The time it took in nanoseconds
+    unsigned long allocated: The allocations made meanwhile
+Return value:
+    None
+*/
+static void report(const char *benchmark, const char *variant, size_t message_size,
+                   size_t messages, uint64_t elapsed, unsigned long allocated) {
+    printf("{\"benchmark\":\"%s\",\"variant\":\"%s\",\"message_size\":%zu,\"messages\":%zu,"
+           "\"ns_per_message\":%.1f,\"allocations_per_message\":%.3f}\n",
+           benchmark, variant, message_size, messages, (double)elapsed / messages,
+           (double)allocated / messages);
+    fflush(stdout);
+}
+
+/*
+Description:
+    Fills a buffer with letters.
+Arguments:
+    char *data: The buffer
+    size_t size: The number of letters
+    unsigned long *state: xorshift state, advanced
+Return value:
+    None
+*/
+static void fill_letters(char *data, size_t size, unsigned long *state) {
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    for (size_t i = 0; i < size; i++) {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        data[i] = letters[*state % (sizeof(letters) - 1)];
+    }
+}
+
+/*
+Description:
+    Decides how many messages of a size a benchmark handles, so every case moves about the same
+    number of bytes. Feeding one byte at a time is far slower, so it gets fewer.
+Arguments:
+    size_t message_size: The size of every message
+    int slow: True if the case is fed a byte at a time
+Return value:
+    Returns the number of messages
+*/
+static size_t message_count(size_t message_size, int slow) {
+    size_t messages = MICRO_STREAM_BYTES / (message_size + 8);
+    if (messages > MICRO_MAX_MESSAGES) messages = MICRO_MAX_MESSAGES;
+    if (slow) messages /= 16;
+    return messages > 0 ? messages : 1;
+}
+
+/*
+Description:
+    Builds a stream of "LENGTH MESSAGE" responses.
+Arguments:
+    Stream *stream: Filled in with the responses
+    size_t message_size: The size of every message
+    size_t messages: The number of responses
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int build_stream(Stream *stream, size_t message_size, size_t messages) {
+
+    unsigned long state = 88172645463325252UL;
+    char header[32];
+    int header_length = snprintf(header, sizeof(header), "%zu ", message_size);
+
+    stream->messages = messages;
+    stream->size = 0;
+    stream->data = malloc(messages * (header_length + message_size));
+    stream->spaces = malloc(sizeof(size_t) * messages);
+    if (stream->data == NULL || stream->spaces == NULL) {
+        log_error("Failed to allocate response stream\n");
+        free(stream->data);
+        free(stream->spaces);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < messages; i++) {
+        memcpy(stream->data + stream->size, header, header_length);
+        stream->spaces[i] = stream->size + header_length - 1;
+        stream->size += header_length;
+        fill_letters(stream->data + stream->size, message_size, &state);
+        stream->size += message_size;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Finds where the header split cuts the stream. Every response is cut twice: before the last digit
+    of its length and right after the space that follows it.
+Arguments:
+    const Stream *stream: The responses
+    size_t cut: The index of the cut
+Return value:
+    Returns the offset of the cut
+*/
+static size_t cut_point(const Stream *stream, size_t cut) {
+    size_t space = stream->spaces[cut / 2];
+    return cut % 2 ? space + 1 : space - 1;
+}
+
+/*
+Description:
+    Counts responses. Reports that all have been handled once the expected number has arrived.
+Arguments:
+    const char *data: The response
+    size_t length: The length of data
+    void *context: The number of responses still expected
+Return value:
+    Returns a true value once no more responses are expected
+*/
+static int count_response(const char *data, size_t length, void *context) {
+    size_t *remaining = context;
+    (void)data;
+    (void)length;
+    return --*remaining == 0;
+}
+
+/*
+Description:
+    Writes a whole stream into a socket, then closes it. Runs on its own thread.
+Arguments:
+    void *argument: The Writer
+Return value:
+    Returns NULL
+*/
+static void *write_stream(void *argument) {
+    Writer *writer = argument;
+    size_t written = 0;
+    while (written < writer->stream->size) {
+        ssize_t bytes_written = write(writer->fd, writer->stream->data + written,
+                                      writer->stream->size - written);
+        if (bytes_written <= 0) break;
+        written += bytes_written;
+    }
+    close(writer->fd);
+    return NULL;
+}
+
+/*
+Description:
+    Feeds a response stream to tcp_client_parse_responses() cut the way split says, the same way
+    the receive loops feed it, and measures it.
+Arguments:
+    const Stream *stream: The responses
+    size_t message_size: The size of every message
+    Split split: How to cut the stream
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int bench_framing(const Stream *stream, size_t message_size, Split split) {
+
+    ResponseBuffer responses;
+    size_t remaining = stream->messages;
+    int handled = 0;
+
+    if (split == SPLIT_SOCKETPAIR) {
+        int fds[2];
+        pthread_t thread;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+            log_error("Failed to create socketpair\n");
+            return EXIT_FAILURE;
+        }
+        Writer writer = {fds[1], stream};
+
+        uint64_t start = now_ns();
+        pthread_create(&thread, NULL, &write_stream, &writer);
+        // pthread_create() allocates too, so only count from here
+        unsigned long allocated = allocations;
+        int status = tcp_client_receive_responses(fds[0], &count_response, NULL, NULL, &remaining);
+        uint64_t elapsed = now_ns() - start;
+        pthread_join(thread, NULL);
+        close(fds[0]);
+
+        if (status || remaining != 0) {
+            log_error("Socketpair framing lost responses\n");
+            return EXIT_FAILURE;
+        }
+        report("framing", SPLIT_NAMES[split], message_size, stream->messages, elapsed,
+               allocations - allocated);
+        return EXIT_SUCCESS;
+    }
+
+    if (tcp_client_response_buffer_init(&responses, TCP_CLIENT_DEFAULT_BUFFER_SIZE)) {
+        return EXIT_FAILURE;
+    }
+
+    unsigned long allocated = allocations;
+    uint64_t start = now_ns();
+    size_t offset = 0, next_cut = 0;
+
+    while (offset < stream->size) {
+        size_t end;
+        switch (split) {
+        case SPLIT_BYTE:
+            end = offset + 1;
+            break;
+
+        case SPLIT_HEADER:
+            // cut between the last two digits of every length and right after its space
+            while (next_cut < 2 * stream->messages && cut_point(stream, next_cut) <= offset) {
+                next_cut++;
+            }
+            end = next_cut < 2 * stream->messages ? cut_point(stream, next_cut) : stream->size;
+            break;
+
+        default:
+            end = offset + MICRO_RECV_SIZE;
+        }
+        if (end > stream->size) end = stream->size;
+
+        if (tcp_client_response_buffer_append(&responses, stream->data + offset, end - offset) ||
+            tcp_client_parse_responses(&responses, &count_response, &remaining, &handled) ==
+                TCP_CLIENT_PARSE_FAILED) {
+            free(responses.data);
+            return EXIT_FAILURE;
+        }
+        offset = end;
+    }
+
+    uint64_t elapsed = now_ns() - start;
+    unsigned long allocated_after = allocations;
+    free(responses.data);
+
+    if ((size_t)handled != stream->messages) {
+        log_error("Framing handled %d of %zu responses\n", handled, stream->messages);
+        return EXIT_FAILURE;
+    }
+    report("framing", SPLIT_NAMES[split], message_size, stream->messages, elapsed,
+           allocated_after - allocated);
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Builds client input, "ACTION MESSAGE" per line. With noisy set, every valid line is preceded by
+    lines a reader has to skip: an empty one, one with an unknown action and one starting with a
+    space.
+Arguments:
+    size_t message_size: The size of every message
+    size_t lines: The number of valid lines
+    int noisy: True to add lines that must be skipped
+    size_t *size: Receives the size of the input
+Return value:
+    Returns the input, or NULL on failure
+*/
+static char *build_lines(size_t message_size, size_t lines, int noisy, size_t *size) {
+
+    static const char noise[] = "\nupcase skipped\n reverse skipped\n";
+    unsigned long state = 88172645463325252UL;
+    char *data = malloc(lines * (message_size + 11 + (noisy ? sizeof(noise) : 0)));
+    if (data == NULL) {
+        log_error("Failed to allocate input\n");
+        return NULL;
+    }
+
+    *size = 0;
+    for (size_t i = 0; i < lines; i++) {
+        if (noisy) {
+            memcpy(data + *size, noise, sizeof(noise) - 1);
+            *size += sizeof(noise) - 1;
+        }
+        memcpy(data + *size, "uppercase ", 10);
+        *size += 10;
+        fill_letters(data + *size, message_size, &state);
+        *size += message_size;
+        data[(*size)++] = '\n';
+    }
+    return data;
+}
+
+/*
+Description:
+    Reads every request out of in-memory input with the request reader, walking the memory in place
+    as it does a mapped file, and measures it. With LINE_READER_BATCH every request is also framed
+    into a batch, which is emptied as if it had been sent whenever it fills up.
+Arguments:
+    char *data: The input
+    size_t size: The size of data
+    size_t message_size: The size of every message
+    size_t lines: The number of valid lines in data
+    LineReader line_reader: Which path to measure
+    const char *variant: Describes the input
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int bench_lines(char *data, size_t size, size_t message_size, size_t lines,
+                       LineReader line_reader, const char *variant) {
+
+    char benchmark[64];
+    size_t read_lines = 0;
+    RequestReader reader;
+    RequestBatch batch;
+    Request request;
+
+    snprintf(benchmark, sizeof(benchmark), "lines_%s", LINE_READER_NAMES[line_reader]);
+    if (tcp_client_batch_init(&batch, TCP_CLIENT_DEFAULT_BATCH_SIZE,
+                              TCP_CLIENT_DEFAULT_FLUSH_THRESHOLD)) {
+        return EXIT_FAILURE;
+    }
+
+    unsigned long allocated = allocations;
+    uint64_t start = now_ns();
+
+    reader_open_memory(&reader, data, size);
+    while (reader_next(&reader, &request) != -1) {
+        read_lines++;
+        if (line_reader == LINE_READER_BATCH && tcp_client_batch_add_request(&batch, &request)) {
+            tcp_client_batch_sent(&batch, batch.bytes_pending);
+        }
+    }
+    reader_close(&reader);
+
+    uint64_t elapsed = now_ns() - start;
+    unsigned long allocated_after = allocations;
+    tcp_client_batch_free(&batch);
+
+    if (read_lines != lines) {
+        log_error("%s read %zu of %zu lines\n", benchmark, read_lines, lines);
+        return EXIT_FAILURE;
+    }
+    report(benchmark, variant, message_size, lines, elapsed, allocated_after - allocated);
+    return EXIT_SUCCESS;
+}
+
+int main(void) {
+
+    log_set_level(LOG_ERROR);
+
+    for (size_t i = 0; i < sizeof(MESSAGE_SIZES) / sizeof(MESSAGE_SIZES[0]); i++) {
+        for (Split split = 0; split < NUMBER_OF_SPLITS; split++) {
+            Stream stream;
+            if (build_stream(&stream, MESSAGE_SIZES[i],
+                             message_count(MESSAGE_SIZES[i], split == SPLIT_BYTE))) {
+                exit(EXIT_FAILURE);
+            }
+            int status = bench_framing(&stream, MESSAGE_SIZES[i], split);
+            free(stream.data);
+            free(stream.spaces);
+            if (status) exit(EXIT_FAILURE);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(MESSAGE_SIZES) / sizeof(MESSAGE_SIZES[0]); i++) {
+        for (int noisy = 0; noisy <= 1; noisy++) {
+            size_t size, lines = message_count(MESSAGE_SIZES[i], false);
+            char *data = build_lines(MESSAGE_SIZES[i], lines, noisy, &size);
+            if (data == NULL) exit(EXIT_FAILURE);
+
+            for (LineReader line_reader = 0; line_reader < NUMBER_OF_LINE_READERS; line_reader++) {
+                if (bench_lines(data, size, MESSAGE_SIZES[i], lines, line_reader,
+                                noisy ? "noisy" : "clean")) {
+                    free(data);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            free(data);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,33 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "tcp_server.h"
+
+void handle_signal(int signal_number) {
+    (void)signal_number;
+    tcp_server_stop();
+}
+
+int main(int argc, char *argv[]) {
+
+    log_set_level(LOG_ERROR);
+
+    ServerConfig config;
+    Server server;
+
+    tcp_server_parse_arguments(argc, argv, &config);
+
+    // no SA_RESTART, so the wait returns and the loop sees the stop
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = &handle_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    if (tcp_server_listen(&server, config)) exit(EXIT_FAILURE);
+    int status = tcp_server_run(&server);
+    tcp_server_free(&server);
+    return status;
+}
@@ -0,0 +1,562 @@
+// accept4()
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "tcp_server.h"
+
+#define ALL_OPTIONS_PARSED -1
+#define MAX_ACTION_LENGTH 16
+#define MAX_LENGTH_DIGITS 19
+#define MAX_MESSAGE_LENGTH (1UL << 30)
+#define SHORT_OPTIONS "vh:p:"
+#define HELP_MESSAGE "\n\
+    Usage: tcp_server [--help] [-v] [-h HOST] [-p PORT]\n\
+    \n\
+    Answers tcp_client requests (uppercase, lowercase, reverse,\n\
+    shuffle, random) on every connection until interrupted.\n\
+    \n\
+    Options:\n\
+    --help\n\
+    -v, --verbose\n\
+    --host HOSTNAME, -h HOSTNAME\n\
+    --port PORT, -p PORT\n"
+
+static volatile sig_atomic_t stop_requested = 0;
+
+/*
+Description:
+    Checks if a string is a non-empty run of digits.
+Arguments:
+    char *string: The string to check
+Return value:
+    Returns a true value if the string is a number, otherwise false
+*/
+static int is_number(char *string) {
+    if (*string == '\0') return false;
+    for (size_t i = 0; string[i] != '\0'; i++) {
+        if (!isdigit((unsigned char)string[i])) return false;
+    }
+    return true;
+}
+
+/*
+Description:
+    Parses the commandline arguments and options given to the server.
+Arguments:
+    int argc: the amount of arguments provided to the program (provided by the main function)
+    char *argv[]: the array of arguments provided to the program (provided by the main function)
+    ServerConfig *config: An empty ServerConfig struct that will be filled in by this function.
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_server_parse_arguments(int argc, char *argv[], ServerConfig *config) {
+
+    config->port = TCP_SERVER_DEFAULT_PORT;
+    config->host = TCP_SERVER_DEFAULT_HOST;
+
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 0},
+        {"verbose", no_argument, 0, 'v'},
+        {"host", required_argument, 0, 'h'},
+        {"port", required_argument, 0, 'p'},
+        {0, 0, 0, 0}
+    };
+
+    while (1) {
+        int option_index = 0;
+        int getopt_return_value = getopt_long(argc, argv, SHORT_OPTIONS, long_options,
+                                              &option_index);
+
+        // exit loop if all arguments are parsed
+        if (getopt_return_value == ALL_OPTIONS_PARSED) break;
+
+        switch (getopt_return_value) {
+        case 0:
+            printf(HELP_MESSAGE);
+            exit(EXIT_SUCCESS);
+
+        case 'v':
+            log_set_level(LOG_TRACE);
+            log_info("Verbose is ON\n");
+            break;
+
+        case 'h':
+            config->host = optarg;
+            log_info("Host is set to '%s'\n", optarg);
+            break;
+
+        case 'p':
+            if (!is_number(optarg)) {
+                log_error("'%s' is not a valid port\n", optarg);
+                printf(HELP_MESSAGE);
+                exit(EXIT_FAILURE);
+            }
+            config->port = optarg;
+            log_info("Port is set to '%s'\n", optarg);
+            break;
+
+        default:
+            printf(HELP_MESSAGE);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc) {
+        log_error("Too many arguments!\n");
+        printf(HELP_MESSAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Advances a xorshift generator. Good enough to shuffle and invent messages, and cheap enough not
+    to show up next to the network.
+Arguments:
+    unsigned long *state: The generator state, never zero
+Return value:
+    Returns the next pseudo-random number
+*/
+static unsigned long next_random(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/*
+Description:
+    Applies an action to a message, the way the server answers a request.
+Arguments:
+    Action action: The action to apply
+    const char *message: The message
+    size_t length: The length of message
+    char *result: Receives length bytes of transformed message
+    unsigned long *random_state: State for shuffle and random, advanced as they use it
+Return value:
+    None
+*/
+void tcp_server_transform(Action action, const char *message, size_t length, char *result,
+                          unsigned long *random_state) {
+
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+    switch (action) {
+    case ACTION_UPPERCASE:
+        for (size_t i = 0; i < length; i++) result[i] = toupper((unsigned char)message[i]);
+        break;
+
+    case ACTION_LOWERCASE:
+        for (size_t i = 0; i < length; i++) result[i] = tolower((unsigned char)message[i]);
+        break;
+
+    case ACTION_REVERSE:
+        for (size_t i = 0; i < length; i++) result[i] = message[length - 1 - i];
+        break;
+
+    case ACTION_SHUFFLE:
+        // fisher-yates
+        memcpy(result, message, length);
+        for (size_t i = length; i > 1; i--) {
+            size_t j = next_random(random_state) % i;
+            char swap = result[i - 1];
+            result[i - 1] = result[j];
+            result[j] = swap;
+        }
+        break;
+
+    case ACTION_RANDOM:
+        for (size_t i = 0; i < length; i++) {
+            result[i] = letters[next_random(random_state) % (sizeof(letters) - 1)];
+        }
+        break;
+
+    default:
+        memcpy(result, message, length);
+    }
+}
+
+/*
+Description:
+    Makes room for more bytes at the end of a buffer, dropping consumed bytes first.
+Arguments:
+    ServerBuffer *buffer: The buffer
+    size_t extra: The number of bytes that must fit after length
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int buffer_reserve(ServerBuffer *buffer, size_t extra) {
+
+    if (buffer->capacity - buffer->length >= extra) return EXIT_SUCCESS;
+
+    if (buffer->start > 0) {
+        memmove(buffer->data, buffer->data + buffer->start, buffer->length - buffer->start);
+        buffer->length -= buffer->start;
+        buffer->start = 0;
+        if (buffer->capacity - buffer->length >= extra) return EXIT_SUCCESS;
+    }
+
+    size_t capacity = buffer->capacity ? buffer->capacity : TCP_SERVER_RECV_SIZE;
+    while (capacity - buffer->length < extra) capacity *= 2;
+
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL) {
+        log_error("Failed to grow connection buffer\n");
+        return EXIT_FAILURE;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Answers every complete request at the front of a buffer, appending each response to another.
+    A request is "ACTION LENGTH MESSAGE" and its response is "LENGTH TRANSFORMED_MESSAGE". A
+    LENGTH over 1 GiB is treated as malformed.
+Arguments:
+    ServerBuffer *input: The received bytes; complete requests are consumed from it
+    ServerBuffer *output: Responses are appended to it
+    unsigned long *random_state: State for shuffle and random
+Return value:
+    Returns a 1 if the input is not a valid request stream, 0 on success
+*/
+int tcp_server_answer(ServerBuffer *input, ServerBuffer *output, unsigned long *random_state) {
+
+    while (input->start < input->length) {
+        const char *request = input->data + input->start;
+        size_t available = input->length - input->start;
+
+        const char *space = memchr(request, ' ', available);
+        if (space == NULL) {
+            if (available > MAX_ACTION_LENGTH) break;
+            return EXIT_SUCCESS;
+        }
+        Action action = action_lookup(request, space - request);
+        if (action == ACTION_INVALID) {
+            log_error("Unknown action '%.*s'\n", (int)(space - request), request);
+            return EXIT_FAILURE;
+        }
+
+        // digits up to the next space
+        const char *digit = space + 1;
+        const char *end = request + available;
+        size_t length = 0;
+        while (digit < end && isdigit((unsigned char)*digit) &&
+               digit - space <= MAX_LENGTH_DIGITS) {
+            length = length * 10 + (*digit - '0');
+            digit++;
+        }
+        // otherwise the buffer would grow for as long as the client keeps sending
+        if (length > MAX_MESSAGE_LENGTH) {
+            log_error("Length after '%.*s' is over %lu bytes\n", (int)(space - request), request,
+                      MAX_MESSAGE_LENGTH);
+            return EXIT_FAILURE;
+        }
+        if (digit == end) return EXIT_SUCCESS;
+        if (*digit != ' ' || digit == space + 1) {
+            log_error("Malformed length after '%.*s'\n", (int)(space - request), request);
+            return EXIT_FAILURE;
+        }
+
+        const char *message = digit + 1;
+        if ((size_t)(end - message) < length) return EXIT_SUCCESS;
+
+        char header[MAX_LENGTH_DIGITS + 2];
+        int header_length = snprintf(header, sizeof(header), "%zu ", length);
+        if (buffer_reserve(output, header_length + length)) return EXIT_FAILURE;
+        memcpy(output->data + output->length, header, header_length);
+        tcp_server_transform(action, message, length, output->data + output->length + header_length,
+                             random_state);
+        output->length += header_length + length;
+        input->start = (message - input->data) + length;
+    }
+
+    if (input->start < input->length) {
+        log_error("Malformed request\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Closes a connection and forgets it.
+Arguments:
+    ServerConnection *connection: The connection to close
+Return value:
+    None
+*/
+static void connection_close(ServerConnection *connection) {
+    Server *server = connection->server;
+    event_loop_remove(&server->loop, &connection->handler);
+    close(connection->handler.fd);
+    free(connection->input.data);
+    free(connection->output.data);
+    free(connection);
+    server->connections--;
+    log_debug("Connection closed, %d open\n", server->connections);
+}
+
+/*
+Description:
+    Sends as much pending output as the socket takes.
+Arguments:
+    ServerConnection *connection: The connection
+Return value:
+    Returns a 1 if the connection failed, 0 on success
+*/
+static int connection_flush(ServerConnection *connection) {
+
+    ServerBuffer *output = &connection->output;
+
+    while (output->start < output->length) {
+        ssize_t bytes_sent = send(connection->handler.fd, output->data + output->start,
+                                  output->length - output->start, MSG_NOSIGNAL);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            log_debug("Send failed: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        output->start += bytes_sent;
+    }
+    if (output->start == output->length) {
+        output->start = 0;
+        output->length = 0;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Reads and answers requests, then writes what the socket takes. Called by the event loop.
+Arguments:
+    EventHandler *handler: The connection's handler
+    uint32_t events: The epoll events that are ready
+Return value:
+    None
+*/
+static void connection_ready(EventHandler *handler, uint32_t events) {
+
+    ServerConnection *connection = (ServerConnection *)handler;
+    Server *server = connection->server;
+
+    if (!connection->end_of_input && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        ServerBuffer *input = &connection->input;
+        if (buffer_reserve(input, TCP_SERVER_RECV_SIZE)) {
+            connection_close(connection);
+            return;
+        }
+        ssize_t bytes_received = recv(handler->fd, input->data + input->length,
+                                      input->capacity - input->length, 0);
+        if (bytes_received == 0) {
+            connection->end_of_input = true;
+        } else if (bytes_received == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                connection_close(connection);
+                return;
+            }
+        } else {
+            input->length += bytes_received;
+        }
+
+        if (tcp_server_answer(input, &connection->output, &connection->random_state)) {
+            connection_close(connection);
+            return;
+        }
+    }
+
+    if (connection_flush(connection)) {
+        connection_close(connection);
+        return;
+    }
+
+    int output_pending = connection->output.length > connection->output.start;
+    if (connection->end_of_input && !output_pending) {
+        connection_close(connection);
+        return;
+    }
+
+    uint32_t wanted = (connection->end_of_input ? 0 : EPOLLIN) | (output_pending ? EPOLLOUT : 0);
+    if (event_loop_watch(&server->loop, handler, wanted)) connection_close(connection);
+}
+
+/*
+Description:
+    Accepts every connection waiting on the listening socket. Called by the event loop.
+Arguments:
+    EventHandler *handler: The server's handler
+    uint32_t events: The epoll events that are ready
+Return value:
+    None
+*/
+static void listener_ready(EventHandler *handler, uint32_t events) {
+
+    Server *server = (Server *)handler;
+    (void)events;
+
+    while (1) {
+        int fd = accept4(handler->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_error("Accept failed!\n");
+            return;
+        }
+
+        // responses are batched already, so don't hold the tail back
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        ServerConnection *connection = calloc(1, sizeof(ServerConnection));
+        if (connection == NULL) {
+            log_error("Failed to allocate connection\n");
+            close(fd);
+            continue;
+        }
+        connection->handler.callback = &connection_ready;
+        connection->handler.fd = fd;
+        connection->server = server;
+        connection->random_state = ((unsigned long)time(NULL) << 16) ^ (unsigned long)fd ^ 1;
+
+        if (event_loop_add(&server->loop, &connection->handler, EPOLLIN)) {
+            log_error("Failed to watch connection\n");
+            close(fd);
+            free(connection);
+            continue;
+        }
+        server->connections++;
+        log_debug("Connection accepted, %d open\n", server->connections);
+    }
+}
+
+/*
+Description:
+    Binds a listening socket to the configured host and port and starts accepting connections on
+    an epoll event loop.
+Arguments:
+    Server *server: The server to start
+    ServerConfig config: Where to listen
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_server_listen(Server *server, ServerConfig config) {
+
+    struct addrinfo hints, *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    server->connections = 0;
+    server->handler.callback = &listener_ready;
+    server->handler.fd = -1;
+    server->loop.epfd = -1;
+
+    int status = getaddrinfo(config.host, config.port, &hints, &addresses);
+    if (status != 0) {
+        log_error("getaddrinfo: %s\n", gai_strerror(status));
+        return EXIT_FAILURE;
+    }
+
+    // try each address until one binds
+    for (struct addrinfo *address = addresses; address != NULL; address = address->ai_next) {
+        int fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        address->ai_protocol);
+        if (fd == -1) continue;
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, address->ai_addr, address->ai_addrlen) == 0 &&
+            listen(fd, TCP_SERVER_BACKLOG) == 0) {
+            server->handler.fd = fd;
+            break;
+        }
+        close(fd);
+    }
+    freeaddrinfo(addresses);
+
+    if (server->handler.fd == -1) {
+        log_error("Failed to listen on %s:%s\n", config.host, config.port);
+        return EXIT_FAILURE;
+    }
+
+    if (event_loop_init(&server->loop) ||
+        event_loop_add(&server->loop, &server->handler, EPOLLIN)) {
+        log_error("Failed to watch listening socket\n");
+        tcp_server_free(server);
+        return EXIT_FAILURE;
+    }
+    log_info("Listening on %s:%s\n", config.host, config.port);
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Stops the loop once a stop has been requested. Called by the event loop before every wait.
+Arguments:
+    EventLoop *loop: The loop
+    void *context: Unused
+Return value:
+    None
+*/
+static void server_tick(EventLoop *loop, void *context) {
+    (void)context;
+    if (stop_requested) event_loop_stop(loop);
+}
+
+/*
+Description:
+    Serves connections until tcp_server_stop() is called.
+Arguments:
+    Server *server: A listening server
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_server_run(Server *server) {
+    return event_loop_run(&server->loop, &server_tick, NULL);
+}
+
+/*
+Description:
+    Makes tcp_server_run() return. Safe to call from a signal handler.
+Arguments:
+    None
+Return value:
+    None
+*/
+void tcp_server_stop(void) {
+    stop_requested = 1;
+}
+
+/*
+Description:
+    Closes the listening socket and the event loop. Connections still open are left to exit.
+Arguments:
+    Server *server: The server to free
+Return value:
+    None
+*/
+void tcp_server_free(Server *server) {
+    if (server->handler.fd != -1) close(server->handler.fd);
+    server->handler.fd = -1;
+    event_loop_free(&server->loop);
+}
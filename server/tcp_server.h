@@ -0,0 +1,139 @@
+#ifndef TCP_SERVER_H_
+#define TCP_SERVER_H_
+
+#include <stddef.h>
+
+#include "action.h"
+#include "event_loop.h"
+
+#define TCP_SERVER_DEFAULT_PORT "8081"
+#define TCP_SERVER_DEFAULT_HOST "localhost"
+#define TCP_SERVER_BACKLOG 128
+#define TCP_SERVER_RECV_SIZE 65536
+
+/*
+What the server was asked to do on the command line.
+*/
+typedef struct ServerConfig {
+    char *port;
+    char *host;
+} ServerConfig;
+
+/*
+A growable run of bytes with a read offset. Bytes before start have been consumed and are dropped
+the next time the buffer needs room.
+*/
+typedef struct ServerBuffer {
+    char *data;
+    size_t start;
+    size_t length;
+    size_t capacity;
+} ServerBuffer;
+
+/*
+One client. Requests are parsed out of input as they arrive and their responses are appended to
+output, which is written whenever the socket takes it. Input is never paused for output, so a
+client that sends everything before reading anything still gets all of its responses.
+*/
+typedef struct ServerConnection {
+    EventHandler handler;
+    struct Server *server;
+    ServerBuffer input;
+    ServerBuffer output;
+    int end_of_input;
+    unsigned long random_state;
+} ServerConnection;
+
+/*
+The listening socket and the loop every connection runs on.
+*/
+typedef struct Server {
+    EventHandler handler;
+    EventLoop loop;
+    int connections;
+} Server;
+
+/*
+Description:
+    Parses the commandline arguments and options given to the server.
+Arguments:
+    int argc: the amount of arguments provided to the program (provided by the main function)
+    char *argv[]: the array of arguments provided to the program (provided by the main function)
+    ServerConfig *config: An empty ServerConfig struct that will be filled in by this function.
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_server_parse_arguments(int argc, char *argv[], ServerConfig *config);
+
+/*
+Description:
+    Applies an action to a message, the way the server answers a request.
+Arguments:
+    Action action: The action to apply
+    const char *message: The message
+    size_t length: The length of message
+    char *result: Receives length bytes of transformed message
+    unsigned long *random_state: State for shuffle and random, advanced as they use it
+Return value:
+    None
+*/
+void tcp_server_transform(Action action, const char *message, size_t length, char *result,
+                          unsigned long *random_state);
+
+/*
+Description:
+    Answers every complete request at the front of a buffer, appending each response to another.
+    A request is "ACTION LENGTH MESSAGE" and its response is "LENGTH TRANSFORMED_MESSAGE". A
+    LENGTH over 1 GiB is treated as malformed.
+Arguments:
+    ServerBuffer *input: The received bytes; complete requests are consumed from it
+    ServerBuffer *output: Responses are appended to it
+    unsigned long *random_state: State for shuffle and random
+Return value:
+    Returns a 1 if the input is not a valid request stream, 0 on success
+*/
+int tcp_server_answer(ServerBuffer *input, ServerBuffer *output, unsigned long *random_state);
+
+/*
+Description:
+    Binds a listening socket to the configured host and port and starts accepting connections on
+    an epoll event loop.
+Arguments:
+    Server *server: The server to start
+    ServerConfig config: Where to listen
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_server_listen(Server *server, ServerConfig config);
+
+/*
+Description:
+    Serves connections until tcp_server_stop() is called.
+Arguments:
+    Server *server: A listening server
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_server_run(Server *server);
+
+/*
+Description:
+    Makes tcp_server_run() return. Safe to call from a signal handler.
+Arguments:
+    None
+Return value:
+    None
+*/
+void tcp_server_stop(void);
+
+/*
+Description:
+    Closes the listening socket and the event loop. Connections still open are left to exit.
+Arguments:
+    Server *server: The server to free
+Return value:
+    None
+*/
+void tcp_server_free(Server *server);
+
+#endif
@@ -0,0 +1,61 @@
+#include <string.h>
+
+#include "action.h"
+
+const ActionToken ACTION_TOKENS[NUMBER_OF_ACTIONS] = {
+    [ACTION_UPPERCASE] = {"uppercase ", 10},
+    [ACTION_LOWERCASE] = {"lowercase ", 10},
+    [ACTION_REVERSE] = {"reverse ", 8},
+    [ACTION_SHUFFLE] = {"shuffle ", 8},
+    [ACTION_RANDOM] = {"random ", 7},
+};
+
+/*
+Description:
+    Resolves an action name without a string compare per candidate: the length and first character
+    pick the only action it could be, and a single memcmp confirms it.
+Arguments:
+    const char *name: The action name, not necessarily null terminated
+    size_t length: The length of name
+Return value:
+    Returns the matching Action, or ACTION_INVALID if there is none
+*/
+Action action_lookup(const char *name, size_t length) {
+
+    Action candidate;
+
+    if (length == 0) return ACTION_INVALID;
+
+    switch (length) {
+    case 9:
+        if (name[0] == 'u') {
+            candidate = ACTION_UPPERCASE;
+        } else if (name[0] == 'l') {
+            candidate = ACTION_LOWERCASE;
+        } else {
+            return ACTION_INVALID;
+        }
+        break;
+
+    case 7:
+        if (name[0] == 'r') {
+            candidate = ACTION_REVERSE;
+        } else if (name[0] == 's') {
+            candidate = ACTION_SHUFFLE;
+        } else {
+            return ACTION_INVALID;
+        }
+        break;
+
+    case 6:
+        candidate = ACTION_RANDOM;
+        break;
+
+    default:
+        return ACTION_INVALID;
+    }
+
+    // the token carries a trailing space the name doesn't
+    if (memcmp(name, ACTION_TOKENS[candidate].text, length)) return ACTION_INVALID;
+    return candidate;
+}
@@ -0,0 +1,41 @@
+#ifndef ACTION_H_
+#define ACTION_H_
+
+#include <stddef.h>
+
+/*
+The actions the server understands.
+*/
+typedef enum Action {
+    ACTION_INVALID = -1,
+    ACTION_UPPERCASE,
+    ACTION_LOWERCASE,
+    ACTION_REVERSE,
+    ACTION_SHUFFLE,
+    ACTION_RANDOM,
+    NUMBER_OF_ACTIONS
+} Action;
+
+/*
+An action as it is sent on the wire, including the space that follows it.
+*/
+typedef struct ActionToken {
+    const char *text;
+    size_t length;
+} ActionToken;
+
+extern const ActionToken ACTION_TOKENS[NUMBER_OF_ACTIONS];
+
+/*
+Description:
+    Resolves an action name without a string compare per candidate: the length and first character
+    pick the only action it could be, and a single memcmp confirms it.
+Arguments:
+    const char *name: The action name, not necessarily null terminated
+    size_t length: The length of name
+Return value:
+    Returns the matching Action, or ACTION_INVALID if there is none
+*/
+Action action_lookup(const char *name, size_t length);
+
+#endif
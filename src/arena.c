@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "log.h"
+
+#define ARENA_ALIGNMENT 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+/*
+Description:
+    Prepares an empty arena. No memory is allocated until the first arena_alloc().
+Arguments:
+    Arena *arena: The arena to initialize
+    size_t chunk_size: The size of each chunk the arena grows by
+Return value:
+    None
+*/
+void arena_init(Arena *arena, size_t chunk_size) {
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->chunk_size = chunk_size;
+    arena->last = NULL;
+}
+
+/*
+Description:
+    Allocates memory from the arena, aligned for any type.
+Arguments:
+    Arena *arena: The arena to allocate from
+    size_t size: The number of bytes needed
+Return value:
+    Returns NULL on failure, a pointer to the memory on success
+*/
+void *arena_alloc(Arena *arena, size_t size) {
+
+    size = ALIGN_UP(size);
+
+    // move on to chunks kept from before the last reset before growing
+    while (arena->current != NULL && arena->current->size - arena->current->used < size) {
+        if (arena->current->next == NULL || arena->current->next->size < size) break;
+        arena->current = arena->current->next;
+    }
+
+    if (arena->current == NULL || arena->current->size - arena->current->used < size) {
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+        ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+        if (chunk == NULL) {
+            log_error("Failed to allocate arena chunk\n");
+            return NULL;
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+
+        // splice the new chunk in after the current one so kept chunks stay reachable
+        if (arena->current == NULL) {
+            chunk->next = arena->first;
+            arena->first = chunk;
+        } else {
+            chunk->next = arena->current->next;
+            arena->current->next = chunk;
+        }
+        arena->current = chunk;
+        log_debug("Arena grew by %zu bytes\n", chunk_size);
+    }
+
+    void *ptr = arena->current->data + arena->current->used;
+    arena->current->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+/*
+Description:
+    Resizes an allocation. The most recent allocation is grown in place when its chunk has room;
+    otherwise a new block is allocated and the old contents are copied into it.
+Arguments:
+    Arena *arena: The arena ptr was allocated from
+    void *ptr: The allocation to grow
+    size_t old_size: The current size of ptr
+    size_t new_size: The size needed
+Return value:
+    Returns NULL on failure, a pointer to the resized memory on success
+*/
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+
+    if (ptr != NULL && ptr == arena->last) {
+        size_t start = (char *)ptr - arena->current->data;
+        if (arena->current->size - start >= ALIGN_UP(new_size)) {
+            arena->current->used = start + ALIGN_UP(new_size);
+            return ptr;
+        }
+    }
+
+    void *grown = arena_alloc(arena, new_size);
+    if (grown != NULL && ptr != NULL) memcpy(grown, ptr, old_size);
+    return grown;
+}
+
+/*
+Description:
+    Releases every allocation made from the arena while keeping its chunks for reuse.
+Arguments:
+    Arena *arena: The arena to reset
+Return value:
+    None
+*/
+void arena_reset(Arena *arena) {
+    for (ArenaChunk *chunk = arena->first; chunk != NULL; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    arena->current = arena->first;
+    arena->last = NULL;
+}
+
+/*
+Description:
+    Returns all of the arena's chunks to the heap.
+Arguments:
+    Arena *arena: The arena to free
+Return value:
+    None
+*/
+void arena_free(Arena *arena) {
+    ArenaChunk *chunk = arena->first;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena_init(arena, arena->chunk_size);
+}
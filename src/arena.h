@@ -0,0 +1,86 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_DEFAULT_CHUNK_SIZE 65536
+
+/*
+One block of arena memory. used bytes of data have been handed out.
+*/
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaChunk;
+
+/*
+A bump allocator. Allocations are carved out of large chunks and are never freed one at a time;
+arena_reset() releases everything at once but keeps the chunks, so an arena that is reset after
+every batch stops touching the heap once it has grown to the size of a batch.
+*/
+typedef struct Arena {
+    ArenaChunk *first;
+    ArenaChunk *current;
+    size_t chunk_size;
+    void *last;
+} Arena;
+
+/*
+Description:
+    Prepares an empty arena. No memory is allocated until the first arena_alloc().
+Arguments:
+    Arena *arena: The arena to initialize
+    size_t chunk_size: The size of each chunk the arena grows by
+Return value:
+    None
+*/
+void arena_init(Arena *arena, size_t chunk_size);
+
+/*
+Description:
+    Allocates memory from the arena, aligned for any type.
+Arguments:
+    Arena *arena: The arena to allocate from
+    size_t size: The number of bytes needed
+Return value:
+    Returns NULL on failure, a pointer to the memory on success
+*/
+void *arena_alloc(Arena *arena, size_t size);
+
+/*
+Description:
+    Resizes an allocation. The most recent allocation is grown in place when its chunk has room;
+    otherwise a new block is allocated and the old contents are copied into it.
+Arguments:
+    Arena *arena: The arena ptr was allocated from
+    void *ptr: The allocation to grow
+    size_t old_size: The current size of ptr
+    size_t new_size: The size needed
+Return value:
+    Returns NULL on failure, a pointer to the resized memory on success
+*/
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+/*
+Description:
+    Releases every allocation made from the arena while keeping its chunks for reuse.
+Arguments:
+    Arena *arena: The arena to reset
+Return value:
+    None
+*/
+void arena_reset(Arena *arena);
+
+/*
+Description:
+    Returns all of the arena's chunks to the heap.
+Arguments:
+    Arena *arena: The arena to free
+Return value:
+    None
+*/
+void arena_free(Arena *arena);
+
+#endif
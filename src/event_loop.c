@@ -0,0 +1,142 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "log.h"
+#include "stats.h"
+
+/*
+Description:
+    Creates the epoll instance behind an event loop.
+Arguments:
+    EventLoop *loop: The loop to initialize
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int event_loop_init(EventLoop *loop) {
+    loop->running = 0;
+    loop->timeout = -1;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1) {
+        log_error("Failed to create epoll instance\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Starts watching a file descriptor.
+Arguments:
+    EventLoop *loop: The loop
+    EventHandler *handler: The handler to call, with fd set
+    uint32_t events: The epoll events to wait for, possibly none
+Return value:
+    Returns a 1 on failure (errno is left set), 0 on success
+*/
+int event_loop_add(EventLoop *loop, EventHandler *handler, uint32_t events) {
+    struct epoll_event event = {.events = events, .data = {.ptr = handler}};
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, handler->fd, &event) == -1) return EXIT_FAILURE;
+    handler->events = events;
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Changes the events a handler waits for. Nothing is done if they are unchanged.
+Arguments:
+    EventLoop *loop: The loop
+    EventHandler *handler: A handler previously added to the loop
+    uint32_t events: The epoll events to wait for, possibly none
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int event_loop_watch(EventLoop *loop, EventHandler *handler, uint32_t events) {
+    if (handler->events == events) return EXIT_SUCCESS;
+
+    struct epoll_event event = {.events = events, .data = {.ptr = handler}};
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, handler->fd, &event) == -1) {
+        log_error("Failed to change watched events\n");
+        return EXIT_FAILURE;
+    }
+    handler->events = events;
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Stops watching a file descriptor.
+Arguments:
+    EventLoop *loop: The loop
+    EventHandler *handler: A handler previously added to the loop
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int event_loop_remove(EventLoop *loop, EventHandler *handler) {
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, handler->fd, NULL) == -1) {
+        log_error("Failed to stop watching file descriptor\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Waits for events and dispatches them to their handlers until event_loop_stop() is called.
+Arguments:
+    EventLoop *loop: The loop to run
+    void (*tick)(EventLoop *, void *): Called before every wait
+    void *context: Passed to tick unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int event_loop_run(EventLoop *loop, void (*tick)(EventLoop *, void *), void *context) {
+
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    loop->running = 1;
+    while (1) {
+        tick(loop, context);
+        if (!loop->running) return EXIT_SUCCESS;
+
+        int ready = epoll_wait(loop->epfd, events, EVENT_LOOP_MAX_EVENTS, loop->timeout);
+        STATS_ADD(syscalls, 1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            log_error("Epoll wait failed!\n");
+            return EXIT_FAILURE;
+        }
+
+        for (int i = 0; i < ready && loop->running; i++) {
+            EventHandler *handler = events[i].data.ptr;
+            handler->callback(handler, events[i].events);
+        }
+        if (!loop->running) return EXIT_SUCCESS;
+    }
+}
+
+/*
+Description:
+    Makes event_loop_run() return once the current round of events has been dispatched.
+Arguments:
+    EventLoop *loop: The loop to stop
+Return value:
+    None
+*/
+void event_loop_stop(EventLoop *loop) {
+    loop->running = 0;
+}
+
+/*
+Description:
+    Closes the epoll instance behind an event loop.
+Arguments:
+    EventLoop *loop: The loop to free
+Return value:
+    None
+*/
+void event_loop_free(EventLoop *loop) {
+    if (loop->epfd != -1) close(loop->epfd);
+    loop->epfd = -1;
+}
@@ -0,0 +1,108 @@
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define EVENT_LOOP_MAX_EVENTS 256
+
+/*
+Something that is registered with an event loop. It is embedded as the first member of whatever
+owns the file descriptor, so callback can cast handler back to its owner.
+*/
+typedef struct EventHandler {
+    void (*callback)(struct EventHandler *handler, uint32_t events);
+    int fd;
+    uint32_t events;
+} EventHandler;
+
+/*
+A level-triggered epoll loop. tick runs before every wait so the owner can queue work and decide
+what it wants to wait for; it stops the loop by calling event_loop_stop(). tick can also set
+timeout to the most milliseconds the next wait may take, -1 (the default) for no limit, so that it
+runs again when something it keeps time for is due.
+*/
+typedef struct EventLoop {
+    int epfd;
+    int running;
+    int timeout;
+} EventLoop;
+
+/*
+Description:
+    Creates the epoll instance behind an event loop.
+Arguments:
+    EventLoop *loop: The loop to initialize
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int event_loop_init(EventLoop *loop);
+
+/*
+Description:
+    Starts watching a file descriptor.
+Arguments:
+    EventLoop *loop: The loop
+    EventHandler *handler: The handler to call, with fd set
+    uint32_t events: The epoll events to wait for, possibly none
+Return value:
+    Returns a 1 on failure (errno is left set), 0 on success
+*/
+int event_loop_add(EventLoop *loop, EventHandler *handler, uint32_t events);
+
+/*
+Description:
+    Changes the events a handler waits for. Nothing is done if they are unchanged.
+Arguments:
+    EventLoop *loop: The loop
+    EventHandler *handler: A handler previously added to the loop
+    uint32_t events: The epoll events to wait for, possibly none
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int event_loop_watch(EventLoop *loop, EventHandler *handler, uint32_t events);
+
+/*
+Description:
+    Stops watching a file descriptor.
+Arguments:
+    EventLoop *loop: The loop
+    EventHandler *handler: A handler previously added to the loop
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int event_loop_remove(EventLoop *loop, EventHandler *handler);
+
+/*
+Description:
+    Waits for events and dispatches them to their handlers until event_loop_stop() is called.
+Arguments:
+    EventLoop *loop: The loop to run
+    void (*tick)(EventLoop *, void *): Called before every wait
+    void *context: Passed to tick unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int event_loop_run(EventLoop *loop, void (*tick)(EventLoop *, void *), void *context);
+
+/*
+Description:
+    Makes event_loop_run() return once the current round of events has been dispatched.
+Arguments:
+    EventLoop *loop: The loop to stop
+Return value:
+    None
+*/
+void event_loop_stop(EventLoop *loop);
+
+/*
+Description:
+    Closes the epoll instance behind an event loop.
+Arguments:
+    EventLoop *loop: The loop to free
+Return value:
+    None
+*/
+void event_loop_free(EventLoop *loop);
+
+#endif
@@ -0,0 +1,264 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+#include "log.h"
+
+// rows per halving of the distance to 100%, as HdrHistogram prints them
+#define LATENCY_TICKS_PER_HALF_DISTANCE 5
+
+/*
+Description:
+    Reads the clock latencies are measured with.
+Arguments:
+    None
+Return value:
+    Returns the monotonic time in nanoseconds
+*/
+uint64_t latency_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+Description:
+    Finds the bucket a value is counted in.
+Arguments:
+    uint64_t value: The value
+Return value:
+    Returns the index of the bucket
+*/
+static int bucket_index(uint64_t value) {
+    if (value < LATENCY_SUB_BUCKET_COUNT) return value;
+
+    // keep the top LATENCY_SUB_BUCKET_BITS - 1 bits below the leading one
+    int shift = 63 - __builtin_clzll(value) - (LATENCY_SUB_BUCKET_BITS - 1);
+    int top = value >> shift;
+    return LATENCY_SUB_BUCKET_COUNT + (shift - 1) * LATENCY_SUB_BUCKET_HALF +
+           (top - LATENCY_SUB_BUCKET_HALF);
+}
+
+/*
+Description:
+    Finds the highest value counted in a bucket.
+Arguments:
+    int index: The index of the bucket
+Return value:
+    Returns the value
+*/
+static uint64_t bucket_highest(int index) {
+    if (index < LATENCY_SUB_BUCKET_COUNT) return index;
+
+    int offset = index - LATENCY_SUB_BUCKET_COUNT;
+    int shift = offset / LATENCY_SUB_BUCKET_HALF + 1;
+    uint64_t top = offset % LATENCY_SUB_BUCKET_HALF + LATENCY_SUB_BUCKET_HALF;
+    return (top << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+/*
+Description:
+    Finds the bucket a percentile falls in.
+Arguments:
+    const LatencyHistogram *histogram: The histogram, not empty
+    double percentile: The percentile, from 0 to 100
+    uint64_t *cumulative: Receives the number of values up to and including the bucket
+Return value:
+    Returns the index of the bucket
+*/
+static int percentile_bucket(const LatencyHistogram *histogram, double percentile,
+                             uint64_t *cumulative) {
+
+    uint64_t wanted = (uint64_t)ceil(percentile / 100.0 * histogram->total);
+    if (wanted == 0) wanted = 1;
+
+    *cumulative = 0;
+    for (int i = 0; i < LATENCY_BUCKET_COUNT; i++) {
+        *cumulative += histogram->counts[i];
+        if (*cumulative >= wanted) return i;
+    }
+    return LATENCY_BUCKET_COUNT - 1;
+}
+
+/*
+Description:
+    Prepares a tracker with an empty histogram.
+Arguments:
+    LatencyTracker *tracker: The tracker to initialize
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int latency_init(LatencyTracker *tracker) {
+    memset(&tracker->histogram, 0, sizeof(LatencyHistogram));
+    tracker->histogram.min = UINT64_MAX;
+    tracker->head = 0;
+    tracker->tail = 0;
+    tracker->mask = LATENCY_INITIAL_IN_FLIGHT - 1;
+    tracker->sent = malloc(sizeof(uint64_t) * LATENCY_INITIAL_IN_FLIGHT);
+    if (tracker->sent == NULL) {
+        log_error("Failed to allocate latency tracker\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Records that requests have just been written to the socket.
+Arguments:
+    LatencyTracker *tracker: The tracker
+    int count: The number of requests
+Return value:
+    None
+*/
+void latency_sent(LatencyTracker *tracker, int count) {
+    uint64_t now = latency_now();
+    for (int i = 0; i < count; i++) latency_sent_at(tracker, now);
+}
+
+/*
+Description:
+    Records that a request was sent, or was meant to be sent, at a given time. Requests must be
+    recorded in the order they are sent.
+Arguments:
+    LatencyTracker *tracker: The tracker
+    uint64_t time: When the request was sent, from latency_now()
+Return value:
+    None
+*/
+void latency_sent_at(LatencyTracker *tracker, uint64_t time) {
+
+    if (tracker->tail - tracker->head > tracker->mask) {
+        // unwrap into a ring twice the size
+        size_t capacity = (tracker->mask + 1) * 2;
+        uint64_t *sent = malloc(sizeof(uint64_t) * capacity);
+        if (sent == NULL) {
+            log_error("Failed to grow latency tracker\n");
+            exit(EXIT_FAILURE);
+        }
+        size_t in_flight = tracker->tail - tracker->head;
+        for (size_t i = 0; i < in_flight; i++) {
+            sent[i] = tracker->sent[(tracker->head + i) & tracker->mask];
+        }
+        free(tracker->sent);
+        tracker->sent = sent;
+        tracker->head = 0;
+        tracker->tail = in_flight;
+        tracker->mask = capacity - 1;
+    }
+    tracker->sent[tracker->tail++ & tracker->mask] = time;
+}
+
+/*
+Description:
+    Records that the response to the oldest request in flight has just been handled.
+Arguments:
+    LatencyTracker *tracker: The tracker
+Return value:
+    None
+*/
+void latency_completed(LatencyTracker *tracker) {
+    if (tracker->head == tracker->tail) {
+        log_debug("Response without a request in flight\n");
+        return;
+    }
+    uint64_t sent = tracker->sent[tracker->head++ & tracker->mask];
+    latency_record(&tracker->histogram, latency_now() - sent);
+}
+
+/*
+Description:
+    Adds a value to a histogram.
+Arguments:
+    LatencyHistogram *histogram: The histogram
+    uint64_t value: The latency in nanoseconds
+Return value:
+    None
+*/
+void latency_record(LatencyHistogram *histogram, uint64_t value) {
+    histogram->counts[bucket_index(value)]++;
+    histogram->total++;
+    if (value < histogram->min) histogram->min = value;
+    if (value > histogram->max) histogram->max = value;
+    histogram->sum += value;
+    histogram->sum_of_squares += (double)value * value;
+}
+
+/*
+Description:
+    Finds the value at a percentile of a histogram.
+Arguments:
+    const LatencyHistogram *histogram: The histogram
+    double percentile: The percentile, from 0 to 100
+Return value:
+    Returns the highest value equivalent to the bucket the percentile falls in, 0 if empty
+*/
+uint64_t latency_value_at_percentile(const LatencyHistogram *histogram, double percentile) {
+    uint64_t cumulative;
+    if (histogram->total == 0) return 0;
+
+    uint64_t value = bucket_highest(percentile_bucket(histogram, percentile, &cumulative));
+    return value < histogram->max ? value : histogram->max;
+}
+
+/*
+Description:
+    Writes a histogram as a percentile distribution in HdrHistogram's .hgrm text format, with
+    values in microseconds, so the usual plotting tools read it.
+Arguments:
+    const LatencyHistogram *histogram: The histogram
+    FILE *file: Where to write it
+Return value:
+    None
+*/
+void latency_report(const LatencyHistogram *histogram, FILE *file) {
+
+    fprintf(file, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+            "1/(1-Percentile)");
+
+    if (histogram->total > 0) {
+        double percentile = 0;
+        while (1) {
+            uint64_t cumulative;
+            int index = percentile_bucket(histogram, percentile, &cumulative);
+            if (cumulative >= histogram->total) break;
+
+            uint64_t value = bucket_highest(index);
+            fprintf(file, "%12.3f %2.12f %10" PRIu64 " %14.2f\n", value / 1000.0,
+                    (double)cumulative / histogram->total, cumulative,
+                    1 / (1 - percentile / 100.0));
+
+            // halve the distance to 100% every LATENCY_TICKS_PER_HALF_DISTANCE rows
+            double half_distances = floor(log2(100.0 / (100.0 - percentile))) + 1;
+            percentile += 100.0 / (LATENCY_TICKS_PER_HALF_DISTANCE * pow(2, half_distances));
+        }
+        fprintf(file, "%12.3f %2.12f %10" PRIu64 "\n", histogram->max / 1000.0, 1.0,
+                histogram->total);
+    }
+
+    double mean = histogram->total ? histogram->sum / histogram->total : 0;
+    double variance = histogram->total ? histogram->sum_of_squares / histogram->total - mean * mean
+                                       : 0;
+    fprintf(file, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1000.0,
+            sqrt(variance > 0 ? variance : 0) / 1000.0);
+    fprintf(file, "#[Max     = %12.3f, Total count    = %12" PRIu64 "]\n",
+            histogram->max / 1000.0, histogram->total);
+    fprintf(file, "#[Buckets = %12d, SubBuckets     = %12d]\n",
+            64 - LATENCY_SUB_BUCKET_BITS + 1, LATENCY_SUB_BUCKET_COUNT);
+}
+
+/*
+Description:
+    Releases the tracker's ring of send times.
+Arguments:
+    LatencyTracker *tracker: The tracker to free
+Return value:
+    None
+*/
+void latency_free(LatencyTracker *tracker) {
+    free(tracker->sent);
+    tracker->sent = NULL;
+}
@@ -0,0 +1,140 @@
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// every power of two is split into 128 linear steps, so any value is within 1/128 of its bucket
+#define LATENCY_SUB_BUCKET_BITS 8
+#define LATENCY_SUB_BUCKET_COUNT (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_SUB_BUCKET_HALF (LATENCY_SUB_BUCKET_COUNT / 2)
+#define LATENCY_BUCKET_COUNT \
+    (LATENCY_SUB_BUCKET_COUNT + (64 - LATENCY_SUB_BUCKET_BITS) * LATENCY_SUB_BUCKET_HALF)
+#define LATENCY_INITIAL_IN_FLIGHT 1024
+
+/*
+An HDR-style histogram of nanosecond latencies. Values below LATENCY_SUB_BUCKET_COUNT get a bucket
+each; above that every power of two gets LATENCY_SUB_BUCKET_HALF equal buckets, so the whole 64-bit
+range fits in a fixed array with a bounded relative error and recording is a few shifts.
+*/
+typedef struct LatencyHistogram {
+    uint64_t counts[LATENCY_BUCKET_COUNT];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+    double sum_of_squares;
+} LatencyHistogram;
+
+/*
+Matches requests with their responses by pipeline order: the send time of every request that has
+been written to the socket waits in a ring until the response at the same position arrives. The
+ring doubles when more requests are in flight than it holds.
+*/
+typedef struct LatencyTracker {
+    LatencyHistogram histogram;
+    uint64_t *sent;
+    size_t head;
+    size_t tail;
+    size_t mask;
+} LatencyTracker;
+
+/*
+Description:
+    Reads the clock latencies are measured with.
+Arguments:
+    None
+Return value:
+    Returns the monotonic time in nanoseconds
+*/
+uint64_t latency_now(void);
+
+/*
+Description:
+    Prepares a tracker with an empty histogram.
+Arguments:
+    LatencyTracker *tracker: The tracker to initialize
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int latency_init(LatencyTracker *tracker);
+
+/*
+Description:
+    Records that requests have just been written to the socket.
+Arguments:
+    LatencyTracker *tracker: The tracker
+    int count: The number of requests
+Return value:
+    None
+*/
+void latency_sent(LatencyTracker *tracker, int count);
+
+/*
+Description:
+    Records that a request was sent, or was meant to be sent, at a given time. Requests must be
+    recorded in the order they are sent.
+Arguments:
+    LatencyTracker *tracker: The tracker
+    uint64_t time: When the request was sent, from latency_now()
+Return value:
+    None
+*/
+void latency_sent_at(LatencyTracker *tracker, uint64_t time);
+
+/*
+Description:
+    Records that the response to the oldest request in flight has just been handled.
+Arguments:
+    LatencyTracker *tracker: The tracker
+Return value:
+    None
+*/
+void latency_completed(LatencyTracker *tracker);
+
+/*
+Description:
+    Adds a value to a histogram.
+Arguments:
+    LatencyHistogram *histogram: The histogram
+    uint64_t value: The latency in nanoseconds
+Return value:
+    None
+*/
+void latency_record(LatencyHistogram *histogram, uint64_t value);
+
+/*
+Description:
+    Finds the value at a percentile of a histogram.
+Arguments:
+    const LatencyHistogram *histogram: The histogram
+    double percentile: The percentile, from 0 to 100
+Return value:
+    Returns the highest value equivalent to the bucket the percentile falls in, 0 if empty
+*/
+uint64_t latency_value_at_percentile(const LatencyHistogram *histogram, double percentile);
+
+/*
+Description:
+    Writes a histogram as a percentile distribution in HdrHistogram's .hgrm text format, with
+    values in microseconds, so the usual plotting tools read it.
+Arguments:
+    const LatencyHistogram *histogram: The histogram
+    FILE *file: Where to write it
+Return value:
+    None
+*/
+void latency_report(const LatencyHistogram *histogram, FILE *file);
+
+/*
+Description:
+    Releases the tracker's ring of send times.
+Arguments:
+    LatencyTracker *tracker: The tracker to free
+Return value:
+    None
+*/
+void latency_free(LatencyTracker *tracker);
+
+#endif
@@ -38,6 +38,8 @@ static struct {
   Callback callbacks[MAX_CALLBACKS];
 } L;
 
+int log_threshold = LOG_TRACE;
+
 
 static const char *level_strings[] = {
   "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"
@@ -81,6 +83,15 @@ static void file_callback(log_Event *ev) {
 }
 
 
+static void update_threshold(void) {
+  int threshold = L.quiet ? LOG_FATAL + 1 : L.level;
+  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+    if (L.callbacks[i].level < threshold) { threshold = L.callbacks[i].level; }
+  }
+  log_threshold = threshold;
+}
+
+
 static void lock(void)   {
   if (L.lock) { L.lock(true, L.udata); }
 }
@@ -104,11 +115,13 @@ void log_set_lock(log_LockFn fn, void *udata) {
 
 void log_set_level(int level) {
   L.level = level;
+  update_threshold();
 }
 
 
 void log_set_quiet(bool enable) {
   L.quiet = enable;
+  update_threshold();
 }
 
 
@@ -116,6 +129,7 @@ int log_add_callback(log_LogFn fn, void *udata, int level) {
   for (int i = 0; i < MAX_CALLBACKS; i++) {
     if (!L.callbacks[i].fn) {
       L.callbacks[i] = (Callback) { fn, udata, level };
+      update_threshold();
       return 0;
     }
   }
@@ -145,6 +159,8 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
     .level = level,
   };
 
+  if (level < log_threshold) { return; }
+
   lock();
 
   if (!L.quiet && level >= L.level) {
@@ -30,12 +30,33 @@ typedef void (*log_LockFn)(bool lock, void *udata);
 
 enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 
-#define log_trace(...) log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_log(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define log_info(...)  log_log(LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_warn(...)  log_log(LOG_WARN,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_error(...) log_log(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define log_fatal(...) log_log(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+/* calls below this level are compiled out, e.g. -DLOG_MIN_LEVEL=LOG_INFO */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_TRACE
+#endif
+
+/* lowest level any output still wants, kept up to date by the setters */
+extern int log_threshold;
+
+static inline bool log_enabled(int level) {
+  return level >= log_threshold;
+}
+
+/* the constant test drops the call at any optimization level; the arguments are only evaluated
+ * once the level is known to be wanted */
+#define log_at(level, ...) \
+  do { \
+    if ((level) >= LOG_MIN_LEVEL && log_enabled(level)) { \
+      log_log(level, __FILE__, __LINE__, __VA_ARGS__); \
+    } \
+  } while (0)
+
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO,  __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN,  __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_fatal(...) log_at(LOG_FATAL, __VA_ARGS__)
 
 const char* log_level_string(int level);
 void log_set_lock(log_LockFn fn, void *udata);
@@ -1,17 +1,66 @@
 #include <stdio.h>
 
+#include "latency.h"
 #include "log.h"
+#include "output.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "rate.h"
+#include "shard.h"
+#include "stats.h"
 #include "tcp_client.h"
+#include "uring.h"
 
-int requests_sent = 0;
-int responses_received = 0;
-int sockfd;
+/*
+Counts requests and responses so handle_response knows when the last response has arrived, and
+holds the sink responses are written to and, with --latency-report, the latency tracker.
+*/
+typedef struct Progress {
+    int requests_sent;
+    int responses_received;
+    OutputSink output;
+    LatencyTracker *latency;
+} Progress;
 
-int handle_response(char *response) {
+/*
+Description:
+    Prints the latency histogram to stderr and frees the tracker, if there is one.
+Arguments:
+    Progress *progress: The run's progress
+Return value:
+    None
+*/
+static void report_latency(Progress *progress) {
+    if (progress->latency == NULL) return;
+    latency_report(&progress->latency->histogram, stderr);
+    latency_free(progress->latency);
+}
+
+int handle_response(const char *response, size_t length, void *context) {
+    Progress *progress = context;
     log_debug("Got to complete message!");
-    printf("%s\n", response);
-    responses_received++;
-    return (responses_received == requests_sent);
+    if (output_write(&progress->output, response, length)) exit(EXIT_FAILURE);
+    if (progress->latency != NULL) latency_completed(progress->latency);
+    progress->responses_received++;
+    return (progress->responses_received == progress->requests_sent);
+}
+
+void begin_response(size_t length, void *context) {
+    (void)context;
+    log_debug("Streaming a %zu byte response\n", length);
+}
+
+void handle_response_chunk(const char *data, size_t length, void *context) {
+    Progress *progress = context;
+    if (output_append(&progress->output, data, length)) exit(EXIT_FAILURE);
+}
+
+int end_response(void *context) {
+    Progress *progress = context;
+    if (output_append(&progress->output, "\n", 1)) exit(EXIT_FAILURE);
+    if (progress->latency != NULL) latency_completed(progress->latency);
+    progress->responses_received++;
+    return (progress->responses_received == progress->requests_sent);
 }
 
 int main(int argc, char *argv[]) {
@@ -19,27 +68,103 @@ int main(int argc, char *argv[]) {
     log_set_level(LOG_ERROR);
 
     Config config;
-    char *action;
-    char *message;
-    int line_length = 0;
+    Progress progress = {0, 0, {0}, NULL};
+    LatencyTracker latency;
+    RequestReader reader;
+    Request request;
 
     tcp_client_parse_arguments(argc, argv, &config);
-    sockfd = tcp_client_connect(config);
-    FILE *fd = tcp_client_open_file(config.file);
-
-    while (line_length != -1) {
-        line_length = tcp_client_get_line(fd, &action, &message);
-        if (line_length == -1) break;
-        tcp_client_send_request(sockfd, action, message);
-        requests_sent++;
-        free(action);
-        free(message);
-    }    
-
-    tcp_client_close_file(fd);
-    if (requests_sent != 0) {
-        tcp_client_receive_response(sockfd, &handle_response);  
+    // before any other thread starts, so they all leave SIGUSR1 to the stats thread, if any
+    if (stats_start(config.stats_interval)) exit(EXIT_FAILURE);
+    StreamHandler stream = {&begin_response, &handle_response_chunk, &end_response,
+                            config.stream_threshold};
+    if (output_init(&progress.output, STDOUT_FILENO, config.output_interval)) exit(EXIT_FAILURE);
+    // lets the event loops flush responses that waited out the interval with nothing after them
+    config.output = &progress.output;
+
+    // responses from several connections can't be matched to their requests by order
+    if (config.latency_report && !config.rate && (config.threads > 1 || config.connections > 1)) {
+        log_warn("--latency-report only works on one connection, ignoring it\n");
+    } else if (config.latency_report) {
+        if (latency_init(&latency)) exit(EXIT_FAILURE);
+        config.latency = &latency;
+        progress.latency = &latency;
+    }
+
+    // an open-loop run paces a single connection itself
+    if (config.rate > 0) {
+        int sockfd = tcp_client_connect(config);
+        if (reader_open(&reader, config.file)) exit(EXIT_FAILURE);
+        int status = rate_run(sockfd, &reader, config, &handle_response, &stream, &progress);
+        reader_close(&reader);
+        tcp_client_close(sockfd);
+        if (output_free(&progress.output)) status = EXIT_FAILURE;
+        report_latency(&progress);
+        return status;
+    }
+
+    if (config.threads > 1) {
+        if (reader_open(&reader, config.file)) exit(EXIT_FAILURE);
+        int status = pool_run(&reader, config, &handle_response, &progress);
+        reader_close(&reader);
+        if (output_free(&progress.output)) status = EXIT_FAILURE;
+        return status;
+    }
+
+    if (config.connections > 1) {
+        if (reader_open(&reader, config.file)) exit(EXIT_FAILURE);
+        int status = shard_run(&reader, config, &handle_response, &progress);
+        reader_close(&reader);
+        if (output_free(&progress.output)) status = EXIT_FAILURE;
+        return status;
+    }
+
+    int sockfd = tcp_client_connect(config);
+    if (reader_open(&reader, config.file)) exit(EXIT_FAILURE);
+
+    if (config.duplex) {
+        int status;
+        if (config.io_uring) {
+            status = uring_run(sockfd, &reader, config, &handle_response, &stream, &progress);
+        } else if (config.split) {
+            status = pipeline_run(sockfd, &reader, config, &handle_response, &stream, &progress);
+        } else {
+            status = tcp_client_run_duplex(sockfd, &reader, config, &handle_response, &stream,
+                                           &progress);
+        }
+        reader_close(&reader);
+        tcp_client_close(sockfd);
+        if (output_free(&progress.output)) status = EXIT_FAILURE;
+        report_latency(&progress);
+        return status;
+    }
+
+    RequestBatch batch;
+    if (tcp_client_batch_init(&batch, config.batch_size, config.flush_threshold)) {
+        return EXIT_FAILURE;
+    }
+    tcp_client_batch_use_file(&batch, &reader);
+    batch.latency = config.latency;
+
+    while (reader_next(&reader, &request) != -1) {
+        // the batch points into the reader until it is flushed
+        if (tcp_client_batch_add_request(&batch, &request)) {
+            tcp_client_batch_flush(sockfd, &batch);
+            reader_release(&reader);
+        }
+        progress.requests_sent++;
+    }
+    tcp_client_batch_flush(sockfd, &batch);
+    tcp_client_batch_free(&batch);
+
+    reader_close(&reader);
+    int status = EXIT_SUCCESS;
+    if (progress.requests_sent != 0) {
+        status = tcp_client_receive_responses(sockfd, &handle_response, &stream, &progress.output,
+                                              &progress);
     }
     tcp_client_close(sockfd);
-    return EXIT_SUCCESS;
+    if (output_free(&progress.output)) status = EXIT_FAILURE;
+    report_latency(&progress);
+    return status;
 }
@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "output.h"
+#include "stats.h"
+
+// responses at least this large are written from where they are instead of being copied
+#define OUTPUT_DIRECT_SIZE (OUTPUT_BUFFER_SIZE / 4)
+
+static OutputSink *exit_sink = NULL;
+
+/*
+Description:
+    Writes iovecs until all of them are out, waiting if the file is non-blocking and full. stdout
+    can share a non-blocking file description with stdin when both are the same terminal or socket.
+Arguments:
+    int fd: The file descriptor to write to
+    struct iovec *iov: The iovecs to write, trimmed as they are written
+    int iov_count: The number of iovecs
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int write_all(int fd, struct iovec *iov, int iov_count) {
+
+    while (iov_count > 0) {
+        ssize_t bytes_written = writev(fd, iov, iov_count);
+        STATS_ADD(syscalls, 1);
+        if (bytes_written == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            log_error("Failed to write output\n");
+            return EXIT_FAILURE;
+        }
+
+        while (iov_count > 0 && (size_t)bytes_written >= iov->iov_len) {
+            bytes_written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (char *)iov->iov_base + bytes_written;
+            iov->iov_len -= bytes_written;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Writes out whatever the sink still holds when the program exits, including through exit() on
+    an error, so responses handled before the error aren't lost.
+Arguments:
+    None
+Return value:
+    None
+*/
+static void output_at_exit(void) {
+    if (exit_sink != NULL) output_flush(exit_sink);
+}
+
+/*
+Description:
+    Prepares an empty sink. Whatever is still buffered is written out if the program exits.
+Arguments:
+    OutputSink *sink: The sink to initialize
+    int fd: The file descriptor to write to
+    long interval: The most milliseconds a response may stay buffered, or a negative value to only
+        write when the buffer fills
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int output_init(OutputSink *sink, int fd, long interval) {
+
+    memset(sink, 0, sizeof(OutputSink));
+    sink->fd = fd;
+    sink->interval = interval;
+    sink->capacity = OUTPUT_BUFFER_SIZE;
+    sink->buffer = malloc(OUTPUT_BUFFER_SIZE);
+    if (sink->buffer == NULL) {
+        log_error("Failed to allocate output buffer\n");
+        return EXIT_FAILURE;
+    }
+
+    if (exit_sink == NULL) atexit(&output_at_exit);
+    exit_sink = sink;
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Finds how much longer the oldest buffered response may wait.
+Arguments:
+    const OutputSink *sink: The sink, holding something and with an interval
+Return value:
+    Returns the nanoseconds left, 0 or less if the interval is up
+*/
+static long long output_time_left(const OutputSink *sink) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long long waited = (now.tv_sec - sink->oldest.tv_sec) * 1000000000LL +
+                       (now.tv_nsec - sink->oldest.tv_nsec);
+    return sink->interval * 1000000LL - waited;
+}
+
+/*
+Description:
+    Starts the interval clock when the first byte goes into an empty buffer, and writes the buffer
+    out once the oldest response in it has waited long enough.
+Arguments:
+    OutputSink *sink: The sink
+    int was_empty: A true value if the buffer was empty before the last bytes went in
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int output_check_interval(OutputSink *sink, int was_empty) {
+
+    if (sink->interval < 0) return EXIT_SUCCESS;
+
+    if (was_empty) clock_gettime(CLOCK_MONOTONIC, &sink->oldest);
+    return output_expire(sink);
+}
+
+/*
+Description:
+    Writes one response followed by a newline.
+Arguments:
+    OutputSink *sink: The sink
+    const char *data: The response
+    size_t length: The length of the response
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int output_write(OutputSink *sink, const char *data, size_t length) {
+
+    // big enough that copying costs more than an extra iovec
+    if (length >= OUTPUT_DIRECT_SIZE) {
+        struct iovec iov[3] = {
+            {sink->buffer, sink->size},
+            {(char *)data, length},
+            {"\n", 1},
+        };
+        sink->size = 0;
+        return write_all(sink->fd, iov, 3);
+    }
+
+    if (sink->size + length + 1 > sink->capacity && output_flush(sink)) return EXIT_FAILURE;
+
+    int was_empty = sink->size == 0;
+    memcpy(sink->buffer + sink->size, data, length);
+    sink->buffer[sink->size + length] = '\n';
+    sink->size += length + 1;
+    return output_check_interval(sink, was_empty);
+}
+
+/*
+Description:
+    Writes bytes as they are, for responses that arrive in pieces.
+Arguments:
+    OutputSink *sink: The sink
+    const char *data: The bytes to write
+    size_t length: The number of bytes
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int output_append(OutputSink *sink, const char *data, size_t length) {
+
+    if (length >= OUTPUT_DIRECT_SIZE) {
+        struct iovec iov[2] = {
+            {sink->buffer, sink->size},
+            {(char *)data, length},
+        };
+        sink->size = 0;
+        return write_all(sink->fd, iov, 2);
+    }
+
+    if (sink->size + length > sink->capacity && output_flush(sink)) return EXIT_FAILURE;
+
+    int was_empty = sink->size == 0;
+    memcpy(sink->buffer + sink->size, data, length);
+    sink->size += length;
+    return output_check_interval(sink, was_empty);
+}
+
+/*
+Description:
+    Finds how long an event loop may wait before the oldest buffered response has waited the
+    sink's interval.
+Arguments:
+    const OutputSink *sink: The sink, or NULL
+Return value:
+    Returns the milliseconds left, rounded up, 0 if the interval is already up, or -1 if nothing
+    is waiting on the interval
+*/
+int output_timeout(const OutputSink *sink) {
+
+    if (sink == NULL || sink->interval < 0 || sink->size == 0) return -1;
+
+    // rounded up so a loop that wakes at the timeout finds the interval up, not a hair short of it
+    long long left = output_time_left(sink);
+    return left > 0 ? (int)((left + 999999) / 1000000) : 0;
+}
+
+/*
+Description:
+    Writes out everything that is buffered if the oldest buffered response has waited the sink's
+    interval.
+Arguments:
+    OutputSink *sink: The sink, or NULL
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int output_expire(OutputSink *sink) {
+    if (sink == NULL || sink->interval < 0 || sink->size == 0) return EXIT_SUCCESS;
+    if (output_time_left(sink) > 0) return EXIT_SUCCESS;
+    return output_flush(sink);
+}
+
+/*
+Description:
+    Writes out everything that is buffered.
+Arguments:
+    OutputSink *sink: The sink
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int output_flush(OutputSink *sink) {
+
+    if (sink->size == 0) return EXIT_SUCCESS;
+
+    struct iovec iov = {sink->buffer, sink->size};
+    sink->size = 0;
+    return write_all(sink->fd, &iov, 1);
+}
+
+/*
+Description:
+    Writes out everything that is buffered and releases the buffer.
+Arguments:
+    OutputSink *sink: The sink to free
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int output_free(OutputSink *sink) {
+
+    int status = output_flush(sink);
+    free(sink->buffer);
+    sink->buffer = NULL;
+    if (exit_sink == sink) exit_sink = NULL;
+    return status;
+}
@@ -0,0 +1,106 @@
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stddef.h>
+#include <time.h>
+
+#define OUTPUT_BUFFER_SIZE 262144
+
+/*
+Collects responses, one per line, in a large buffer and writes them out in as few system calls as
+possible: when the buffer fills, when the oldest buffered response has waited interval
+milliseconds (if interval is not negative), and at exit. A response too large to be worth copying
+goes out straight from where it is, behind whatever is buffered, in the same writev(). The interval
+is checked whenever a response is written and, so that it holds when no more responses come, by
+event loops that bound their waits with output_timeout() and call output_expire() on waking.
+*/
+typedef struct OutputSink {
+    int fd;
+    char *buffer;
+    size_t size;
+    size_t capacity;
+    long interval;
+    struct timespec oldest;
+} OutputSink;
+
+/*
+Description:
+    Prepares an empty sink. Whatever is still buffered is written out if the program exits.
+Arguments:
+    OutputSink *sink: The sink to initialize
+    int fd: The file descriptor to write to
+    long interval: The most milliseconds a response may stay buffered, or a negative value to only
+        write when the buffer fills
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int output_init(OutputSink *sink, int fd, long interval);
+
+/*
+Description:
+    Writes one response followed by a newline.
+Arguments:
+    OutputSink *sink: The sink
+    const char *data: The response
+    size_t length: The length of the response
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int output_write(OutputSink *sink, const char *data, size_t length);
+
+/*
+Description:
+    Writes bytes as they are, for responses that arrive in pieces.
+Arguments:
+    OutputSink *sink: The sink
+    const char *data: The bytes to write
+    size_t length: The number of bytes
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int output_append(OutputSink *sink, const char *data, size_t length);
+
+/*
+Description:
+    Finds how long an event loop may wait before the oldest buffered response has waited the
+    sink's interval.
+Arguments:
+    const OutputSink *sink: The sink, or NULL
+Return value:
+    Returns the milliseconds left, rounded up, 0 if the interval is already up, or -1 if nothing
+    is waiting on the interval
+*/
+int output_timeout(const OutputSink *sink);
+
+/*
+Description:
+    Writes out everything that is buffered if the oldest buffered response has waited the sink's
+    interval.
+Arguments:
+    OutputSink *sink: The sink, or NULL
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int output_expire(OutputSink *sink);
+
+/*
+Description:
+    Writes out everything that is buffered.
+Arguments:
+    OutputSink *sink: The sink
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int output_flush(OutputSink *sink);
+
+/*
+Description:
+    Writes out everything that is buffered and releases the buffer.
+Arguments:
+    OutputSink *sink: The sink to free
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int output_free(OutputSink *sink);
+
+#endif
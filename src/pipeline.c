@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "pipeline.h"
+#include "stats.h"
+
+/*
+Description:
+    Wakes the thread sleeping on an eventfd.
+Arguments:
+    int fd: The eventfd
+Return value:
+    None
+*/
+static void pipeline_wake(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) == -1) log_debug("Failed to wake thread\n");
+}
+
+/*
+Description:
+    Clears an eventfd after its thread has woken up.
+Arguments:
+    int fd: The eventfd
+Return value:
+    None
+*/
+static void pipeline_drain(int fd) {
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) == -1) log_debug("Nothing to drain\n");
+}
+
+/*
+Description:
+    The body of the reader thread: reads requests and pushes them into the ring, sleeping while the
+    ring is full. Buffers the reader has moved past are reclaimed once the network thread reports
+    that every request read from them has been sent, and the reader doesn't move past a second
+    buffer until then, so at most two read buffers are ever in use.
+Arguments:
+    void *argument: The pipeline
+Return value:
+    Returns NULL
+*/
+static void *pipeline_read(void *argument) {
+
+    Pipeline *pipeline = argument;
+    RequestReader *reader = pipeline->reader;
+    Request request;
+    unsigned long pushed = 0;
+    unsigned long retired = 0;
+    int retired_pending = false;
+    int live_arena = reader->live_arena;
+
+    while (!__atomic_load_n(&pipeline->stop, __ATOMIC_ACQUIRE)) {
+
+        // about to move to a new buffer with the old one still in use, so wait for it to drain
+        // rather than let the reader's memory grow without bound
+        while (retired_pending && reader->scanned_next == reader->scanned_count &&
+               __atomic_load_n(&pipeline->requests_flushed, __ATOMIC_ACQUIRE) < retired) {
+            __atomic_store_n(&pipeline->producer_waiting, true, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&pipeline->requests_flushed, __ATOMIC_ACQUIRE) < retired &&
+                !__atomic_load_n(&pipeline->stop, __ATOMIC_ACQUIRE)) {
+                pipeline_drain(pipeline->space_ready_fd);
+            }
+            __atomic_store_n(&pipeline->producer_waiting, false, __ATOMIC_RELAXED);
+            if (__atomic_load_n(&pipeline->stop, __ATOMIC_ACQUIRE)) return NULL;
+        }
+
+        if (retired_pending &&
+            __atomic_load_n(&pipeline->requests_flushed, __ATOMIC_ACQUIRE) >= retired) {
+            reader_release_retired(reader);
+            retired_pending = false;
+        }
+
+        int result = reader_next(reader, &request);
+        if (result == READER_WOULD_BLOCK) {
+            struct pollfd pfds[2] = {{pipeline->input_fd, POLLIN, 0},
+                                     {pipeline->space_ready_fd, POLLIN, 0}};
+            if (poll(pfds, 2, -1) == -1 && errno != EINTR) {
+                log_error("Poll failed!\n");
+                break;
+            }
+            if (pfds[1].revents & POLLIN) pipeline_drain(pipeline->space_ready_fd);
+            continue;
+        }
+        if (result == -1) break;
+
+        // everything pushed so far points into the buffer the reader just moved off
+        if (reader->live_arena != live_arena) {
+            live_arena = reader->live_arena;
+            retired = pushed;
+            retired_pending = true;
+        }
+
+        while (!spsc_push(&pipeline->ring, &request)) {
+            __atomic_store_n(&pipeline->producer_waiting, true, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (spsc_full(&pipeline->ring) && !__atomic_load_n(&pipeline->stop, __ATOMIC_ACQUIRE)) {
+                pipeline_drain(pipeline->space_ready_fd);
+            }
+            __atomic_store_n(&pipeline->producer_waiting, false, __ATOMIC_RELAXED);
+            if (__atomic_load_n(&pipeline->stop, __ATOMIC_ACQUIRE)) return NULL;
+        }
+        pushed++;
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&pipeline->consumer_waiting, __ATOMIC_RELAXED)) {
+            pipeline_wake(pipeline->data_ready_fd);
+        }
+    }
+
+    __atomic_store_n(&pipeline->end_of_file, true, __ATOMIC_RELEASE);
+    pipeline_wake(pipeline->data_ready_fd);
+    return NULL;
+}
+
+/*
+Description:
+    Closes the eventfds and frees the ring. Safe to call on a partly initialized pipeline.
+Arguments:
+    Pipeline *pipeline: The pipeline to free
+Return value:
+    None
+*/
+static void pipeline_free(Pipeline *pipeline) {
+    spsc_free(&pipeline->ring);
+    if (pipeline->space_ready_fd != -1) close(pipeline->space_ready_fd);
+    if (pipeline->data_ready_fd != -1) close(pipeline->data_ready_fd);
+}
+
+/*
+Description:
+    Does the same job as tcp_client_run_duplex(), but reads and splits the input on a thread of its
+    own that hands requests to the network thread through a lock-free single-producer,
+    single-consumer ring of PIPELINE_RING_SIZE requests. A slow read no longer stalls the socket
+    and a slow socket no longer stalls reading, until the ring fills and the reader waits for room.
+Arguments:
+    int sockfd: Socket file descriptor
+    RequestReader *reader: The reader to read requests from
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    const StreamHandler *stream: Handles responses too long to buffer, or NULL to buffer them all
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int pipeline_run(int sockfd, RequestReader *reader, Config config, ResponseHandler handler,
+                 const StreamHandler *stream, void *context) {
+
+    Pipeline pipeline;
+    RequestBatch batch;
+    ResponseBuffer responses;
+    int requests_sent = 0;
+    int responses_received = 0;
+    int end_of_file = 0;
+    int status = EXIT_SUCCESS;
+    Request request;
+
+    memset(&pipeline, 0, sizeof(Pipeline));
+    pipeline.reader = reader;
+    pipeline.data_ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pipeline.space_ready_fd = eventfd(0, EFD_CLOEXEC);
+    if (pipeline.data_ready_fd == -1 || pipeline.space_ready_fd == -1) {
+        log_error("Failed to create eventfd\n");
+        pipeline_free(&pipeline);
+        return EXIT_FAILURE;
+    }
+    if (spsc_init(&pipeline.ring, PIPELINE_RING_SIZE)) {
+        pipeline_free(&pipeline);
+        return EXIT_FAILURE;
+    }
+
+    if (tcp_client_response_buffer_init(&responses, TCP_CLIENT_DEFAULT_BUFFER_SIZE)) {
+        pipeline_free(&pipeline);
+        return EXIT_FAILURE;
+    }
+    responses.stream = stream;
+    if (tcp_client_batch_init(&batch, config.batch_size, config.flush_threshold)) {
+        free(responses.data);
+        pipeline_free(&pipeline);
+        return EXIT_FAILURE;
+    }
+    tcp_client_batch_use_file(&batch, reader);
+    batch.latency = config.latency;
+
+    if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        log_error("Failed to make socket non-blocking\n");
+        tcp_client_batch_free(&batch);
+        free(responses.data);
+        pipeline_free(&pipeline);
+        return EXIT_FAILURE;
+    }
+
+    // the reader waits for a quiet input with poll(), where it can be told to stop
+    pipeline.input_fd = reader_set_nonblocking(reader);
+    if (pthread_create(&pipeline.thread, NULL, &pipeline_read, &pipeline) != 0) {
+        log_error("Failed to start reader thread\n");
+        tcp_client_batch_free(&batch);
+        free(responses.data);
+        pipeline_free(&pipeline);
+        return EXIT_FAILURE;
+    }
+
+    while (1) {
+
+        // fill the batch from the ring while there is room in the window
+        while (!end_of_file && !tcp_client_batch_full(&batch) &&
+               (config.window == 0 || requests_sent - responses_received < config.window)) {
+            if (spsc_pop(&pipeline.ring, &request)) {
+                tcp_client_batch_add_request(&batch, &request);
+                requests_sent++;
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&pipeline.producer_waiting, __ATOMIC_RELAXED)) {
+                    pipeline_wake(pipeline.space_ready_fd);
+                }
+                continue;
+            }
+            // the reader only sets end_of_file after its last push
+            if (__atomic_load_n(&pipeline.end_of_file, __ATOMIC_ACQUIRE) &&
+                spsc_empty(&pipeline.ring)) {
+                end_of_file = 1;
+            }
+            break;
+        }
+
+        // the input may have just run out with nothing left in flight
+        if (end_of_file && responses_received == requests_sent) break;
+
+        struct pollfd pfds[2] = {{sockfd, POLLIN, 0}, {pipeline.data_ready_fd, POLLIN, 0}};
+        int nfds = 1;
+        if (batch.count > 0) pfds[0].events |= POLLOUT;
+
+        // the ring ran dry while there is room for more, so also wait for the reader
+        if (!end_of_file && !tcp_client_batch_full(&batch) &&
+            (config.window == 0 || requests_sent - responses_received < config.window)) {
+            __atomic_store_n(&pipeline.consumer_waiting, true, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (!spsc_empty(&pipeline.ring) ||
+                __atomic_load_n(&pipeline.end_of_file, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&pipeline.consumer_waiting, false, __ATOMIC_RELAXED);
+                continue;
+            }
+            nfds = 2;
+        }
+
+        // wake up for buffered output that has waited out its interval, even if nothing arrives
+        int ready = poll(pfds, nfds, output_timeout(config.output));
+        STATS_ADD(syscalls, 1);
+        __atomic_store_n(&pipeline.consumer_waiting, false, __ATOMIC_RELAXED);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            log_error("Poll failed!\n");
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (output_expire(config.output)) {
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        if (nfds == 2 && (pfds[1].revents & POLLIN)) pipeline_drain(pipeline.data_ready_fd);
+
+        if (pfds[0].revents & POLLOUT) {
+            int count = batch.count;
+            tcp_client_batch_flush(sockfd, &batch);
+            // lets the reader reuse buffers whose requests have all gone out
+            if (batch.count == 0) {
+                __atomic_add_fetch(&pipeline.requests_flushed, count, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&pipeline.producer_waiting, __ATOMIC_SEQ_CST)) {
+                    pipeline_wake(pipeline.space_ready_fd);
+                }
+            }
+        }
+
+        if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            int bytes_received = tcp_client_receive_into_buffer(sockfd, &responses);
+            if (bytes_received == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
+                log_error("Receive failed!\n");
+                status = EXIT_FAILURE;
+                break;
+            }
+            // server is done with us, nothing more will arrive
+            if (bytes_received == 0) {
+                log_info("Connection closed.\n");
+                log_error("Connection closed before every request was answered\n");
+                status = EXIT_FAILURE;
+                break;
+            }
+            if (tcp_client_parse_responses(&responses, handler, context, &responses_received) ==
+                TCP_CLIENT_PARSE_FAILED) {
+                status = EXIT_FAILURE;
+                break;
+            }
+        }
+    }
+
+    // wherever the reader is waiting, for room or for input, this gets it to return
+    __atomic_store_n(&pipeline.stop, true, __ATOMIC_RELEASE);
+    pipeline_wake(pipeline.space_ready_fd);
+    pthread_join(pipeline.thread, NULL);
+
+    tcp_client_batch_free(&batch);
+    free(responses.data);
+    pipeline_free(&pipeline);
+    return status;
+}
@@ -0,0 +1,53 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <pthread.h>
+
+#include "reader.h"
+#include "spsc.h"
+#include "tcp_client.h"
+
+#define PIPELINE_RING_SIZE 4096
+
+/*
+What the reader thread and the network thread share. Requests flow through ring; everything else
+is a flag or counter written by one side and read by the other. A side that has nothing to do sets
+its waiting flag and sleeps on an eventfd that the other side only writes to while the flag is
+set, so the fast path never makes a system call. Input that can run dry (input_fd, -1 for a mapped
+file) is read without blocking, and the reader waits for it together with space_ready_fd, so
+setting stop and writing to space_ready_fd always gets the reader to return on its own.
+*/
+typedef struct Pipeline {
+    SpscRing ring;
+    RequestReader *reader;
+    pthread_t thread;
+    int input_fd;
+    int end_of_file;
+    int stop;
+    unsigned long requests_flushed;
+    int data_ready_fd;
+    int space_ready_fd;
+    int consumer_waiting;
+    int producer_waiting;
+} Pipeline;
+
+/*
+Description:
+    Does the same job as tcp_client_run_duplex(), but reads and splits the input on a thread of its
+    own that hands requests to the network thread through a lock-free single-producer,
+    single-consumer ring of PIPELINE_RING_SIZE requests. A slow read no longer stalls the socket
+    and a slow socket no longer stalls reading, until the ring fills and the reader waits for room.
+Arguments:
+    int sockfd: Socket file descriptor
+    RequestReader *reader: The reader to read requests from
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    const StreamHandler *stream: Handles responses too long to buffer, or NULL to buffer them all
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int pipeline_run(int sockfd, RequestReader *reader, Config config, ResponseHandler handler,
+                 const StreamHandler *stream, void *context);
+
+#endif
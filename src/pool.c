@@ -0,0 +1,404 @@
+#include "log.h"
+#include "pool.h"
+
+#define DEQUE_TOP(ends) ((int)((ends) >> 32))
+#define DEQUE_BOTTOM(ends) ((int)(uint32_t)(ends))
+#define DEQUE_ENDS(top, bottom) (((uint64_t)(uint32_t)(top) << 32) | (uint32_t)(bottom))
+
+/*
+One worker thread and the deque it owns.
+*/
+typedef struct Worker {
+    Pool *pool;
+    int index;
+    pthread_t thread;
+} Worker;
+
+/*
+Description:
+    Takes the lowest chunk left in a worker's own deque.
+Arguments:
+    WorkDeque *deque: The worker's deque
+    int *chunk: Set to the index of the chunk taken
+Return value:
+    Returns a true value if a chunk was taken, false if the deque is empty
+*/
+static int deque_take(WorkDeque *deque, int *chunk) {
+    uint64_t ends = __atomic_load_n(&deque->ends, __ATOMIC_ACQUIRE);
+
+    while (DEQUE_TOP(ends) < DEQUE_BOTTOM(ends)) {
+        uint64_t taken = DEQUE_ENDS(DEQUE_TOP(ends) + 1, DEQUE_BOTTOM(ends));
+        if (__atomic_compare_exchange_n(&deque->ends, &ends, taken, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            *chunk = deque->chunks[DEQUE_TOP(ends)];
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+Description:
+    Steals the highest chunk left in another worker's deque, the one its owner would get to last.
+Arguments:
+    WorkDeque *deque: The other worker's deque
+    int *chunk: Set to the index of the chunk stolen
+Return value:
+    Returns a true value if a chunk was stolen, false if the deque is empty
+*/
+static int deque_steal(WorkDeque *deque, int *chunk) {
+    uint64_t ends = __atomic_load_n(&deque->ends, __ATOMIC_ACQUIRE);
+
+    while (DEQUE_TOP(ends) < DEQUE_BOTTOM(ends)) {
+        uint64_t stolen = DEQUE_ENDS(DEQUE_TOP(ends), DEQUE_BOTTOM(ends) - 1);
+        if (__atomic_compare_exchange_n(&deque->ends, &ends, stolen, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            *chunk = deque->chunks[DEQUE_BOTTOM(ends) - 1];
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+Description:
+    Gets the next chunk for a worker: its own lowest chunk, or failing that one stolen from the
+    other workers, trying them in turn.
+Arguments:
+    Pool *pool: The pool
+    int worker: The index of the worker asking
+    int *chunk: Set to the index of the chunk to run
+Return value:
+    Returns a true value if there is a chunk to run, false once every deque is empty
+*/
+static int next_chunk(Pool *pool, int worker, int *chunk) {
+    if (deque_take(&pool->deques[worker], chunk)) return true;
+
+    for (int i = 1; i < pool->worker_count; i++) {
+        if (deque_steal(&pool->deques[(worker + i) % pool->worker_count], chunk)) return true;
+    }
+    return false;
+}
+
+/*
+Description:
+    Records a response in its chunk's output, to be handed out once the chunk's turn comes.
+Arguments:
+    const char *data: The response, pointing into the worker's receive buffer
+    size_t length: The length of the response
+    void *context: The chunk the response belongs to
+Return value:
+    Returns false, the caller decides when a chunk is finished
+*/
+static int collect_response(const char *data, size_t length, void *context) {
+
+    Chunk *chunk = context;
+    size_t needed = chunk->output_size + sizeof(size_t) + length;
+
+    if (needed > chunk->output_capacity) {
+        size_t capacity = chunk->output_capacity ? chunk->output_capacity : chunk->size;
+        while (capacity < needed) capacity *= 2;
+        chunk->output = realloc(chunk->output, capacity);
+        if (chunk->output == NULL) {
+            log_error("Failed to allocate chunk output\n");
+            exit(EXIT_FAILURE);
+        }
+        chunk->output_capacity = capacity;
+    }
+
+    memcpy(chunk->output + chunk->output_size, &length, sizeof(size_t));
+    memcpy(chunk->output + chunk->output_size + sizeof(size_t), data, length);
+    chunk->output_size = needed;
+    return false;
+}
+
+/*
+Description:
+    Marks a chunk finished and, if it is next in line, hands its responses and those of every
+    finished chunk right behind it to the pool's handler.
+Arguments:
+    Pool *pool: The pool
+    Chunk *chunk: The chunk that was just run
+Return value:
+    None
+*/
+static void finish_chunk(Pool *pool, Chunk *chunk) {
+
+    pthread_mutex_lock(&pool->output_lock);
+    chunk->done = true;
+
+    while (pool->next_output < pool->chunk_count && pool->chunks[pool->next_output].done) {
+        Chunk *next = &pool->chunks[pool->next_output];
+        size_t offset = 0;
+        while (offset < next->output_size) {
+            size_t length;
+            memcpy(&length, next->output + offset, sizeof(size_t));
+            offset += sizeof(size_t);
+            pool->handler(next->output + offset, length, pool->context);
+            offset += length;
+        }
+        free(next->output);
+        next->output = NULL;
+        pool->next_output++;
+    }
+    pthread_cond_signal(&pool->output_ready);
+    pthread_mutex_unlock(&pool->output_lock);
+}
+
+/*
+Description:
+    Connects, then runs chunks until there are none left anywhere.
+Arguments:
+    Worker *worker: The worker
+Return value:
+    None
+*/
+static void worker_run_chunks(Worker *worker) {
+
+    Pool *pool = worker->pool;
+    RequestReader reader;
+    Duplex duplex;
+    int chunk;
+
+    // a worker that can't connect leaves its chunks for the others to steal
+    int sockfd = tcp_client_connect(pool->config);
+    if (sockfd == TCP_CLIENT_BAD_SOCKET) {
+        log_error("Worker %d failed to connect\n", worker->index);
+        return;
+    }
+    if (tcp_client_duplex_init(&duplex, sockfd, pool->config, NULL)) {
+        log_error("Worker %d failed to set up its connection\n", worker->index);
+        tcp_client_close(sockfd);
+        return;
+    }
+
+    // the batch and receive buffer are reused, so a chunk costs only its own requests
+    while (next_chunk(pool, worker->index, &chunk)) {
+        reader_open_memory(&reader, pool->chunks[chunk].data, pool->chunks[chunk].size);
+        if (tcp_client_duplex_run(&duplex, &reader, pool->config, &collect_response,
+                                  &pool->chunks[chunk])) {
+            __atomic_store_n(&pool->status, EXIT_FAILURE, __ATOMIC_RELAXED);
+        }
+        finish_chunk(pool, &pool->chunks[chunk]);
+    }
+
+    tcp_client_duplex_free(&duplex);
+    tcp_client_close(sockfd);
+}
+
+/*
+Description:
+    The body of a worker thread: runs chunks, then lets the thread that started it know it is done.
+Arguments:
+    void *argument: The worker
+Return value:
+    Returns NULL
+*/
+static void *worker_run(void *argument) {
+
+    Worker *worker = argument;
+    Pool *pool = worker->pool;
+
+    worker_run_chunks(worker);
+
+    pthread_mutex_lock(&pool->output_lock);
+    pool->workers_done++;
+    pthread_cond_signal(&pool->output_ready);
+    pthread_mutex_unlock(&pool->output_lock);
+    return NULL;
+}
+
+/*
+Description:
+    Waits for every worker to exit, writing out the output in the meantime whenever the oldest
+    response in it has waited its interval, since responses are handed out with nothing left to
+    wait on once the last chunks are done.
+Arguments:
+    Pool *pool: The pool
+    int started: The number of workers that were started
+    OutputSink *output: The sink responses are written to, or NULL
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int wait_for_workers(Pool *pool, int started, OutputSink *output) {
+
+    int status = EXIT_SUCCESS;
+
+    pthread_mutex_lock(&pool->output_lock);
+    while (pool->workers_done < started) {
+        if (output_expire(output)) {
+            // don't keep retrying a sink that can't be written to
+            status = EXIT_FAILURE;
+            output = NULL;
+        }
+
+        int timeout = output_timeout(output);
+        if (timeout < 0) {
+            pthread_cond_wait(&pool->output_ready, &pool->output_lock);
+            continue;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&pool->output_ready, &pool->output_lock, &deadline);
+    }
+    pthread_mutex_unlock(&pool->output_lock);
+    return status;
+}
+
+/*
+Description:
+    Splits the input into chunks of about POOL_CHUNK_SIZE bytes, each ending just after a newline.
+Arguments:
+    Pool *pool: The pool to fill in chunks and chunk_count of
+    const char *data: The whole input
+    size_t size: The number of bytes in data
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int split_chunks(Pool *pool, const char *data, size_t size) {
+
+    size_t offset = 0;
+
+    // every chunk but the last is at least POOL_CHUNK_SIZE bytes
+    pool->chunks = calloc(size / POOL_CHUNK_SIZE + 1, sizeof(Chunk));
+    if (pool->chunks == NULL) {
+        log_error("Failed to allocate chunks\n");
+        return EXIT_FAILURE;
+    }
+
+    while (offset < size) {
+        size_t end = offset + POOL_CHUNK_SIZE;
+        if (end >= size) {
+            end = size;
+        } else {
+            const char *newline = memchr(data + end, '\n', size - end);
+            end = newline != NULL ? (size_t)(newline - data) + 1 : size;
+        }
+        pool->chunks[pool->chunk_count].data = data + offset;
+        pool->chunks[pool->chunk_count].size = end - offset;
+        pool->chunk_count++;
+        offset = end;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Releases the chunks and deques.
+Arguments:
+    Pool *pool: The pool to free
+Return value:
+    None
+*/
+static void pool_free(Pool *pool) {
+    for (int i = 0; i < pool->chunk_count; i++) {
+        free(pool->chunks[i].output);
+    }
+    free(pool->chunks);
+    if (pool->deques != NULL) {
+        for (int i = 0; i < pool->worker_count; i++) {
+            free(pool->deques[i].chunks);
+        }
+    }
+    free(pool->deques);
+    pthread_cond_destroy(&pool->output_ready);
+    pthread_mutex_destroy(&pool->output_lock);
+}
+
+/*
+Description:
+    Splits the input into chunks of about POOL_CHUNK_SIZE bytes and runs them on config.threads
+    worker threads. Each worker owns a connection and its own batch and parse buffers, set up once,
+    and runs the chunks it is dealt with tcp_client_duplex_run(); a worker that runs out steals
+    chunks from the far end of another worker's deque. Responses are handed to handler in input
+    order, on whichever thread finishes the chunk that is next in line, while the calling thread
+    writes out config.output whenever it has waited its interval. Input that isn't a mapped file is
+    read into memory first.
+Arguments:
+    RequestReader *reader: The reader holding the input
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int pool_run(RequestReader *reader, Config config, ResponseHandler handler, void *context) {
+
+    Pool pool;
+    pthread_condattr_t attributes;
+
+    memset(&pool, 0, sizeof(Pool));
+    pool.config = config;
+    // the sink is only touched under output_lock, here, never from inside a worker's own loop
+    pool.config.output = NULL;
+    pool.handler = handler;
+    pool.context = context;
+    pool.status = EXIT_SUCCESS;
+    pthread_mutex_init(&pool.output_lock, NULL);
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool.output_ready, &attributes);
+    pthread_condattr_destroy(&attributes);
+
+    if (reader_load(reader) || split_chunks(&pool, reader->data, reader->size)) {
+        pool_free(&pool);
+        return EXIT_FAILURE;
+    }
+
+    // a connection per chunk at most
+    pool.worker_count = config.threads < pool.chunk_count ? config.threads : pool.chunk_count;
+    pool.deques = calloc(pool.worker_count, sizeof(WorkDeque));
+    Worker *workers = calloc(pool.worker_count, sizeof(Worker));
+    if ((pool.worker_count > 0 && pool.deques == NULL) || workers == NULL) {
+        log_error("Failed to allocate workers\n");
+        free(workers);
+        pool_free(&pool);
+        return EXIT_FAILURE;
+    }
+
+    // deal chunks round robin so every worker starts near the front of the input
+    for (int i = 0; i < pool.worker_count; i++) {
+        int count = (pool.chunk_count - i + pool.worker_count - 1) / pool.worker_count;
+        pool.deques[i].chunks = malloc(sizeof(int) * count);
+        if (pool.deques[i].chunks == NULL) {
+            log_error("Failed to allocate workers\n");
+            free(workers);
+            pool_free(&pool);
+            return EXIT_FAILURE;
+        }
+        for (int j = 0; j < count; j++) {
+            pool.deques[i].chunks[j] = i + j * pool.worker_count;
+        }
+        pool.deques[i].ends = DEQUE_ENDS(0, count);
+    }
+
+    int started = 0;
+    for (; started < pool.worker_count; started++) {
+        workers[started].pool = &pool;
+        workers[started].index = started;
+        if (pthread_create(&workers[started].thread, NULL, &worker_run, &workers[started]) != 0) {
+            log_error("Failed to start worker %d\n", started);
+            break;
+        }
+    }
+    if (wait_for_workers(&pool, started, config.output)) pool.status = EXIT_FAILURE;
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    if (pool.next_output < pool.chunk_count) {
+        log_error("Only %d of %d chunks were run\n", pool.next_output, pool.chunk_count);
+        pool.status = EXIT_FAILURE;
+    }
+
+    int status = pool.status;
+    free(workers);
+    pool_free(&pool);
+    return status;
+}
@@ -0,0 +1,77 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "reader.h"
+#include "tcp_client.h"
+
+#define POOL_CHUNK_SIZE 262144
+
+/*
+A range of the input, always ending just after a newline (or at the end of the input), and the
+responses to its requests once a worker has run it. output holds one record per response: its
+length as a size_t followed by its bytes.
+*/
+typedef struct Chunk {
+    const char *data;
+    size_t size;
+    char *output;
+    size_t output_size;
+    size_t output_capacity;
+    int done;
+} Chunk;
+
+/*
+The chunks one worker starts out with, as indices into the pool's chunk array, lowest first. The
+owner takes from the top and other workers steal from the bottom. Both ends live in one 64 bit word
+(top in the high half, bottom in the low half) so either end moves with a single compare and swap.
+*/
+typedef struct WorkDeque {
+    int *chunks;
+    uint64_t ends;
+} WorkDeque;
+
+/*
+Everything the worker threads share. Chunks are run in any order but handed to handler strictly in
+input order: a worker that finishes the chunk at next_output hands it out along with every finished
+chunk right behind it, under output_lock. output_ready is signalled, also under output_lock, when
+responses have been handed out or a worker has exited (counted in workers_done), so the thread
+that started the workers can keep time for the output interval while it waits for them.
+*/
+typedef struct Pool {
+    Config config;
+    Chunk *chunks;
+    int chunk_count;
+    WorkDeque *deques;
+    int worker_count;
+    pthread_mutex_t output_lock;
+    pthread_cond_t output_ready;
+    int next_output;
+    int workers_done;
+    ResponseHandler handler;
+    void *context;
+    int status;
+} Pool;
+
+/*
+Description:
+    Splits the input into chunks of about POOL_CHUNK_SIZE bytes and runs them on config.threads
+    worker threads. Each worker owns a connection and its own batch and parse buffers, set up once,
+    and runs the chunks it is dealt with tcp_client_duplex_run(); a worker that runs out steals
+    chunks from the far end of another worker's deque. Responses are handed to handler in input
+    order, on whichever thread finishes the chunk that is next in line, while the calling thread
+    writes out config.output whenever it has waited its interval. Input that isn't a mapped file is
+    read into memory first.
+Arguments:
+    RequestReader *reader: The reader holding the input
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int pool_run(RequestReader *reader, Config config, ResponseHandler handler, void *context);
+
+#endif
@@ -0,0 +1,160 @@
+// ppoll()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+
+#include "latency.h"
+#include "log.h"
+#include "rate.h"
+#include "stats.h"
+
+/*
+Description:
+    Runs an open-loop load: request i is due i / config.rate seconds after the start, whether or
+    not earlier responses have arrived, and goes out as soon as it is due. The input is loaded into
+    memory and read again from the top until config.requests requests have been sent (0 for a
+    single pass). If config.latency is set, each request's latency is measured from when it was due
+    rather than when it was written, so time spent waiting behind a slow server or a full socket is
+    counted instead of hidden.
+Arguments:
+    int sockfd: Socket file descriptor
+    RequestReader *reader: The reader to read requests from
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    const StreamHandler *stream: Handles responses too long to buffer, or NULL to buffer them all
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int rate_run(int sockfd, RequestReader *reader, Config config, ResponseHandler handler,
+             const StreamHandler *stream, void *context) {
+
+    RequestBatch batch;
+    ResponseBuffer responses;
+    RequestReader pass;
+    Request request;
+    unsigned long requests_sent = 0;
+    unsigned long responses_received = 0;
+    int pass_sent = 0;
+    int out_of_input = 0;
+    int status = EXIT_SUCCESS;
+    double period = 1e9 / config.rate;
+
+    // every pass reads the same memory, so requests stay valid until the end
+    if (reader_load(reader)) return EXIT_FAILURE;
+    reader_open_memory(&pass, reader->data, reader->size);
+
+    if (tcp_client_response_buffer_init(&responses, TCP_CLIENT_DEFAULT_BUFFER_SIZE)) {
+        return EXIT_FAILURE;
+    }
+    responses.stream = stream;
+    if (tcp_client_batch_init(&batch, config.batch_size, config.flush_threshold)) {
+        free(responses.data);
+        return EXIT_FAILURE;
+    }
+    tcp_client_batch_use_file(&batch, reader);
+
+    if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        log_error("Failed to make socket non-blocking\n");
+        tcp_client_batch_free(&batch);
+        free(responses.data);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t start = latency_now();
+
+    while (1) {
+        uint64_t now = latency_now();
+        uint64_t due = start + (uint64_t)((double)requests_sent * period);
+
+        // queue everything that is due; what doesn't fit is late and its latency shows it
+        while (!out_of_input && due <= now && !tcp_client_batch_full(&batch)) {
+            if (reader_next(&pass, &request) == -1) {
+                if (config.requests == 0 || pass_sent == 0) {
+                    out_of_input = 1;
+                    break;
+                }
+                reader_close(&pass);
+                reader_open_memory(&pass, reader->data, reader->size);
+                pass_sent = 0;
+                continue;
+            }
+            tcp_client_batch_add_request(&batch, &request);
+            if (config.latency != NULL) latency_sent_at(config.latency, due);
+            requests_sent++;
+            pass_sent++;
+            if (config.requests != 0 && requests_sent == config.requests) {
+                out_of_input = 1;
+            }
+            due = start + (uint64_t)((double)requests_sent * period);
+        }
+
+        if (batch.count > 0) tcp_client_batch_flush(sockfd, &batch);
+        if (out_of_input && responses_received == requests_sent) break;
+
+        // sleep until the next request is due, unless it has to wait for room anyway
+        struct timespec timeout, *wait = NULL;
+        uint64_t delay = UINT64_MAX;
+        if (!out_of_input && !tcp_client_batch_full(&batch)) {
+            now = latency_now();
+            delay = due > now ? due - now : 0;
+        }
+        // or until buffered output has waited out its interval, if that comes first
+        int output_wait = output_timeout(config.output);
+        if (output_wait >= 0 && (uint64_t)output_wait * 1000000ULL < delay) {
+            delay = (uint64_t)output_wait * 1000000ULL;
+        }
+        if (delay != UINT64_MAX) {
+            timeout.tv_sec = delay / 1000000000ULL;
+            timeout.tv_nsec = delay % 1000000000ULL;
+            wait = &timeout;
+        }
+
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        if (batch.count > 0) pfd.events |= POLLOUT;
+
+        int ready = ppoll(&pfd, 1, wait, NULL);
+        STATS_ADD(syscalls, 1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            log_error("Poll failed!\n");
+            exit(EXIT_FAILURE);
+        }
+        if (output_expire(config.output)) {
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            int bytes_received = tcp_client_receive_into_buffer(sockfd, &responses);
+            if (bytes_received == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
+                log_error("Receive failed!\n");
+                exit(EXIT_FAILURE);
+            }
+            // server is done with us, nothing more will arrive
+            if (bytes_received == 0) {
+                log_info("Connection closed.\n");
+                log_error("Connection closed before every request was answered\n");
+                status = EXIT_FAILURE;
+                break;
+            }
+            int handled = 0;
+            int result = tcp_client_parse_responses(&responses, handler, context, &handled);
+            responses_received += handled;
+            if (result == TCP_CLIENT_PARSE_FAILED) {
+                status = EXIT_FAILURE;
+                break;
+            }
+        }
+    }
+
+    log_info("Sent %lu requests in %.3f seconds\n", requests_sent, (latency_now() - start) / 1e9);
+    reader_close(&pass);
+    tcp_client_batch_free(&batch);
+    free(responses.data);
+    return status;
+}
@@ -0,0 +1,28 @@
+#ifndef RATE_H_
+#define RATE_H_
+
+#include "reader.h"
+#include "tcp_client.h"
+
+/*
+Description:
+    Runs an open-loop load: request i is due i / config.rate seconds after the start, whether or
+    not earlier responses have arrived, and goes out as soon as it is due. The input is loaded into
+    memory and read again from the top until config.requests requests have been sent (0 for a
+    single pass). If config.latency is set, each request's latency is measured from when it was due
+    rather than when it was written, so time spent waiting behind a slow server or a full socket is
+    counted instead of hidden.
+Arguments:
+    int sockfd: Socket file descriptor
+    RequestReader *reader: The reader to read requests from
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    const StreamHandler *stream: Handles responses too long to buffer, or NULL to buffer them all
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int rate_run(int sockfd, RequestReader *reader, Config config, ResponseHandler handler,
+             const StreamHandler *stream, void *context);
+
+#endif
@@ -0,0 +1,312 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "reader.h"
+#include "scan.h"
+#include "stats.h"
+
+#define READ_CHUNK_SIZE 65536
+
+/*
+Description:
+    Opens a file for reading requests. If "-" is given, stdin will be read.
+Arguments:
+    RequestReader *reader: An empty RequestReader struct that will be filled in by this function.
+    char *file_name: The name of the file to open
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int reader_open(RequestReader *reader, char *file_name) {
+
+    struct stat file_stat;
+
+    memset(reader, 0, sizeof(RequestReader));
+    reader->saved_flags = -1;
+
+    if (strcmp(file_name, "-") == 0) {
+        reader->fd = STDIN_FILENO;
+    } else if ((reader->fd = open(file_name, O_RDONLY)) == -1) {
+        log_error("Failed to open file.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (fstat(reader->fd, &file_stat) == -1) {
+        log_error("Failed to stat file.\n");
+        reader_close(reader);
+        return EXIT_FAILURE;
+    }
+
+    if (S_ISREG(file_stat.st_mode) && reader->fd != STDIN_FILENO) {
+        // check if file is empty
+        if (file_stat.st_size == 0) {
+            log_error("File is empty");
+            reader_close(reader);
+            return EXIT_FAILURE;
+        }
+
+        reader->data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+        if (reader->data != MAP_FAILED) {
+            madvise(reader->data, file_stat.st_size, MADV_SEQUENTIAL);
+            reader->size = file_stat.st_size;
+            reader->mapped = true;
+            reader->end_of_file = true;
+            return EXIT_SUCCESS;
+        }
+        log_debug("Failed to map file, falling back to reads\n");
+    }
+
+    arena_init(&reader->arenas[0], READ_CHUNK_SIZE);
+    arena_init(&reader->arenas[1], READ_CHUNK_SIZE);
+    reader->data = arena_alloc(&reader->arenas[reader->live_arena], READ_CHUNK_SIZE);
+    reader->capacity = READ_CHUNK_SIZE;
+    if (reader->data == NULL) {
+        log_error("Failed to allocate read buffer\n");
+        reader_close(reader);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Sets up a reader over requests that are already in memory. The memory is borrowed: it must
+    outlive the reader and is not freed by reader_close().
+Arguments:
+    RequestReader *reader: An empty RequestReader struct that will be filled in by this function.
+    const char *data: The input lines
+    size_t size: The number of bytes in data
+Return value:
+    None
+*/
+void reader_open_memory(RequestReader *reader, const char *data, size_t size) {
+    memset(reader, 0, sizeof(RequestReader));
+    reader->fd = -1;
+    reader->saved_flags = -1;
+    reader->data = (char *)data;
+    reader->size = size;
+    reader->mapped = true;
+    reader->end_of_file = true;
+}
+
+/*
+Description:
+    Moves the unread tail of the buffer to the front and reads more of the file behind it. If
+    requests handed out earlier still point into the buffer, the tail goes into a new buffer from
+    the other arena and the old one is left alone until reader_release().
+Arguments:
+    RequestReader *reader: The reader to refill
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int reader_refill(RequestReader *reader) {
+
+    size_t partial = reader->size - reader->position;
+    size_t capacity = reader->capacity;
+
+    // a line longer than half the buffer needs more room to finish arriving
+    if (partial * 2 > capacity) capacity *= 2;
+
+    if (reader->outstanding) {
+        int other_arena = 1 - reader->live_arena;
+        char *fresh = arena_alloc(&reader->arenas[other_arena], capacity);
+        if (fresh == NULL) return EXIT_FAILURE;
+        memcpy(fresh, reader->data + reader->position, partial);
+        reader->data = fresh;
+        reader->live_arena = other_arena;
+    } else {
+        memmove(reader->data, reader->data + reader->position, partial);
+        if (capacity != reader->capacity) {
+            char *grown = arena_grow(&reader->arenas[reader->live_arena], reader->data, partial,
+                                     capacity);
+            if (grown == NULL) return EXIT_FAILURE;
+            reader->data = grown;
+        }
+    }
+    reader->capacity = capacity;
+    reader->size = partial;
+    reader->position = 0;
+
+    while (1) {
+        ssize_t bytes_read = read(reader->fd, reader->data + reader->size,
+                                  reader->capacity - reader->size);
+        STATS_ADD(syscalls, 1);
+        if (bytes_read == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return EXIT_SUCCESS;
+            log_error("Failed to read file.\n");
+            return EXIT_FAILURE;
+        }
+        if (bytes_read == 0) reader->end_of_file = true;
+        reader->size += bytes_read;
+        return EXIT_SUCCESS;
+    }
+}
+
+/*
+Description:
+    Gets the next valid request, skipping empty lines, lines starting with a space, lines without a
+    message and lines with an unknown action. The request stays valid until reader_release() is
+    called.
+Arguments:
+    RequestReader *reader: The reader to read from
+    Request *request: Filled in with the request that was read
+Return value:
+    Returns -1 on end of file or failure, READER_WOULD_BLOCK if the reader is non-blocking and no
+    input is ready, the number of characters in the request on success
+*/
+int reader_next(RequestReader *reader, Request *request) {
+
+    while (reader->scanned_next == reader->scanned_count) {
+        size_t consumed;
+
+        // nothing more will be scanned out of what is left
+        if (reader->end_of_file && reader->position == reader->size) return -1;
+
+        reader->scanned_count = scan_requests(reader->data + reader->position,
+                                              reader->size - reader->position, reader->end_of_file,
+                                              reader->scanned, READER_SCAN_BATCH, &consumed);
+        reader->scanned_next = 0;
+        reader->position += consumed;
+
+        // only a partial line is left, read more
+        if (reader->scanned_count == 0 && !reader->end_of_file) {
+            size_t unread = reader->size - reader->position;
+            if (reader_refill(reader)) return -1;
+            if (reader->size == unread && !reader->end_of_file) return READER_WOULD_BLOCK;
+        }
+    }
+
+    *request = reader->scanned[reader->scanned_next++];
+    reader->outstanding = true;
+    return ACTION_TOKENS[request->action].length + request->message_length;
+}
+
+/*
+Description:
+    Reads the rest of the file so that data and size cover the whole input. Mapped files already
+    do; anything else is read to the end into one buffer that grows as needed. Must be called
+    before any request is read.
+Arguments:
+    RequestReader *reader: The reader
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int reader_load(RequestReader *reader) {
+
+    while (!reader->end_of_file) {
+        if (reader->size == reader->capacity) {
+            char *grown = arena_grow(&reader->arenas[reader->live_arena], reader->data,
+                                     reader->size, reader->capacity * 2);
+            if (grown == NULL) {
+                log_error("Failed to allocate read buffer\n");
+                return EXIT_FAILURE;
+            }
+            reader->data = grown;
+            reader->capacity *= 2;
+        }
+
+        ssize_t bytes_read = read(reader->fd, reader->data + reader->size,
+                                  reader->capacity - reader->size);
+        STATS_ADD(syscalls, 1);
+        if (bytes_read == -1) {
+            if (errno == EINTR) continue;
+            log_error("Failed to read file.\n");
+            return EXIT_FAILURE;
+        }
+        if (bytes_read == 0) reader->end_of_file = true;
+        reader->size += bytes_read;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Makes reads from the file non-blocking so the reader can be driven by an event loop. The
+    original file flags are restored by reader_close().
+Arguments:
+    RequestReader *reader: The reader
+Return value:
+    Returns the file descriptor to wait on for input, or -1 if reading never blocks (a mapped file)
+*/
+int reader_set_nonblocking(RequestReader *reader) {
+
+    if (reader->mapped) return -1;
+
+    if (reader->saved_flags == -1) {
+        reader->saved_flags = fcntl(reader->fd, F_GETFL, 0);
+        if (reader->saved_flags == -1 ||
+            fcntl(reader->fd, F_SETFL, reader->saved_flags | O_NONBLOCK) == -1) {
+            log_error("Failed to make file non-blocking\n");
+            reader->saved_flags = -1;
+            return -1;
+        }
+    }
+    return reader->fd;
+}
+
+/*
+Description:
+    Tells the reader that none of the requests it has handed out are in use anymore, so their
+    memory can be reused.
+Arguments:
+    RequestReader *reader: The reader
+Return value:
+    None
+*/
+void reader_release(RequestReader *reader) {
+    // everything but the live buffer is in the other arena
+    if (!reader->mapped) arena_reset(&reader->arenas[1 - reader->live_arena]);
+    reader->outstanding = false;
+}
+
+/*
+Description:
+    Tells the reader that none of the requests it handed out before its live buffer last changed
+    are in use anymore, while later ones may still be. Unlike reader_release(), the live buffer is
+    left alone, so a reader whose requests are consumed on another thread can reclaim memory
+    without waiting for every request to be sent. Watch live_arena to see when the buffer changes.
+Arguments:
+    RequestReader *reader: The reader
+Return value:
+    None
+*/
+void reader_release_retired(RequestReader *reader) {
+    if (!reader->mapped) arena_reset(&reader->arenas[1 - reader->live_arena]);
+}
+
+/*
+Description:
+    Unmaps or frees the reader's memory and closes its file.
+Arguments:
+    RequestReader *reader: The reader to close
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int reader_close(RequestReader *reader) {
+
+    // memory readers have no file and borrow their data
+    if (reader->fd == -1) return EXIT_SUCCESS;
+
+    if (reader->mapped) {
+        munmap(reader->data, reader->size);
+    } else {
+        arena_free(&reader->arenas[0]);
+        arena_free(&reader->arenas[1]);
+    }
+    reader->data = NULL;
+
+    // stdin is shared with whoever started us, so put it back the way it was
+    if (reader->saved_flags != -1) fcntl(reader->fd, F_SETFL, reader->saved_flags);
+
+    if (reader->fd > STDIN_FILENO && close(reader->fd) == -1) {
+        log_error("Failed to close file\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
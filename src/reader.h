@@ -0,0 +1,142 @@
+#ifndef READER_H_
+#define READER_H_
+
+#include <stddef.h>
+
+#include "action.h"
+#include "arena.h"
+
+#define READER_SCAN_BATCH 256
+#define READER_WOULD_BLOCK -2
+
+/*
+One request from the input. message points directly into the reader's buffer and is not null
+terminated.
+*/
+typedef struct Request {
+    Action action;
+    const char *message;
+    size_t message_length;
+} Request;
+
+/*
+Reads requests from a file without copying them. Regular files are mapped into memory and walked
+in place. Anything that can't be mapped (stdin, pipes) is read in large chunks instead. Read
+buffers come from two arenas: a buffer that still has requests pointing into it is left in place
+and the next one is taken from the other arena, which reader_release() then resets, so
+steady-state reading reuses the same memory without touching the heap. Lines are split
+READER_SCAN_BATCH at a time by scan_requests() and handed out from scanned.
+*/
+typedef struct RequestReader {
+    int fd;
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t position;
+    int mapped;
+    int end_of_file;
+    int outstanding;
+    int saved_flags;
+    Arena arenas[2];
+    int live_arena;
+    Request scanned[READER_SCAN_BATCH];
+    size_t scanned_count;
+    size_t scanned_next;
+} RequestReader;
+
+/*
+Description:
+    Opens a file for reading requests. If "-" is given, stdin will be read.
+Arguments:
+    RequestReader *reader: An empty RequestReader struct that will be filled in by this function.
+    char *file_name: The name of the file to open
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int reader_open(RequestReader *reader, char *file_name);
+
+/*
+Description:
+    Sets up a reader over requests that are already in memory. The memory is borrowed: it must
+    outlive the reader and is not freed by reader_close().
+Arguments:
+    RequestReader *reader: An empty RequestReader struct that will be filled in by this function.
+    const char *data: The input lines
+    size_t size: The number of bytes in data
+Return value:
+    None
+*/
+void reader_open_memory(RequestReader *reader, const char *data, size_t size);
+
+/*
+Description:
+    Gets the next valid request, skipping empty lines, lines starting with a space, lines without a
+    message and lines with an unknown action. The request stays valid until reader_release() is
+    called.
+Arguments:
+    RequestReader *reader: The reader to read from
+    Request *request: Filled in with the request that was read
+Return value:
+    Returns -1 on end of file or failure, READER_WOULD_BLOCK if the reader is non-blocking and no
+    input is ready, the number of characters in the request on success
+*/
+int reader_next(RequestReader *reader, Request *request);
+
+/*
+Description:
+    Reads the rest of the file so that data and size cover the whole input. Mapped files already
+    do; anything else is read to the end into one buffer that grows as needed. Must be called
+    before any request is read.
+Arguments:
+    RequestReader *reader: The reader
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int reader_load(RequestReader *reader);
+
+/*
+Description:
+    Makes reads from the file non-blocking so the reader can be driven by an event loop. The
+    original file flags are restored by reader_close().
+Arguments:
+    RequestReader *reader: The reader
+Return value:
+    Returns the file descriptor to wait on for input, or -1 if reading never blocks (a mapped file)
+*/
+int reader_set_nonblocking(RequestReader *reader);
+
+/*
+Description:
+    Tells the reader that none of the requests it has handed out are in use anymore, so their
+    memory can be reused.
+Arguments:
+    RequestReader *reader: The reader
+Return value:
+    None
+*/
+void reader_release(RequestReader *reader);
+
+/*
+Description:
+    Tells the reader that none of the requests it handed out before its live buffer last changed
+    are in use anymore, while later ones may still be. Unlike reader_release(), the live buffer is
+    left alone, so a reader whose requests are consumed on another thread can reclaim memory
+    without waiting for every request to be sent. Watch live_arena to see when the buffer changes.
+Arguments:
+    RequestReader *reader: The reader
+Return value:
+    None
+*/
+void reader_release_retired(RequestReader *reader);
+
+/*
+Description:
+    Unmaps or frees the reader's memory and closes its file.
+Arguments:
+    RequestReader *reader: The reader to close
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int reader_close(RequestReader *reader);
+
+#endif
@@ -0,0 +1,212 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "log.h"
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_HAVE_X86 1
+#endif
+
+#define SCAN_BLOCK_SIZE 64
+#define NO_SPACE ((size_t)-1)
+
+/*
+Finds the newlines and spaces in one 64 byte block, setting bit i of each mask if block[i] matches.
+*/
+typedef void (*StructuralFn)(const char *block, uint64_t *newlines, uint64_t *spaces);
+
+static void structurals_scalar(const char *block, uint64_t *newlines, uint64_t *spaces) {
+    uint64_t newline_mask = 0;
+    uint64_t space_mask = 0;
+    for (int i = 0; i < SCAN_BLOCK_SIZE; i++) {
+        newline_mask |= (uint64_t)(block[i] == '\n') << i;
+        space_mask |= (uint64_t)(block[i] == ' ') << i;
+    }
+    *newlines = newline_mask;
+    *spaces = space_mask;
+}
+
+#ifdef SCAN_HAVE_X86
+__attribute__((target("sse2"))) static void structurals_sse2(const char *block, uint64_t *newlines,
+                                                             uint64_t *spaces) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i space = _mm_set1_epi8(' ');
+    uint64_t newline_mask = 0;
+    uint64_t space_mask = 0;
+    for (int i = 0; i < SCAN_BLOCK_SIZE; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(block + i));
+        newline_mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)) << i;
+        space_mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, space)) << i;
+    }
+    *newlines = newline_mask;
+    *spaces = space_mask;
+}
+
+__attribute__((target("avx2"))) static void structurals_avx2(const char *block, uint64_t *newlines,
+                                                             uint64_t *spaces) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i space = _mm256_set1_epi8(' ');
+    __m256i low = _mm256_loadu_si256((const __m256i *)block);
+    __m256i high = _mm256_loadu_si256((const __m256i *)(block + 32));
+    *newlines = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline)) |
+                (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline)) << 32;
+    *spaces = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, space)) |
+              (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, space)) << 32;
+}
+#endif
+
+static StructuralFn find_structurals = NULL;
+static const char *implementation_name = NULL;
+static pthread_once_t implementation_once = PTHREAD_ONCE_INIT;
+
+/*
+Description:
+    Picks the widest block scanner the CPU supports. Runs once, through pthread_once(), the first
+    time any thread needs it.
+Arguments:
+    None
+Return value:
+    None
+*/
+static void select_implementation(void) {
+    find_structurals = &structurals_scalar;
+    implementation_name = "scalar";
+#ifdef SCAN_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_structurals = &structurals_avx2;
+        implementation_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        find_structurals = &structurals_sse2;
+        implementation_name = "sse2";
+    }
+#endif
+    log_debug("Using %s request scanner\n", implementation_name);
+}
+
+/*
+Description:
+    Gets the name of the scanner implementation chosen for this CPU.
+Arguments:
+    None
+Return value:
+    Returns "avx2", "sse2" or "scalar"
+*/
+const char *scan_implementation(void) {
+    pthread_once(&implementation_once, &select_implementation);
+    return implementation_name;
+}
+
+/*
+Description:
+    Checks one line whose first space is already known and fills in the request if it is valid.
+Arguments:
+    const char *line: The start of the line
+    size_t length: The length of the line, not counting the newline
+    size_t first_space: The offset of the first space in the line, or NO_SPACE
+    Request *request: Filled in with the request if the line is valid
+Return value:
+    Returns a true value if the line holds a valid request, otherwise false
+*/
+static int parse_line(const char *line, size_t length, size_t first_space, Request *request) {
+
+    // skip empty line and line starting with a space
+    if (length == 0 || first_space == 0 || first_space == NO_SPACE) return false;
+
+    const char *message = line + first_space + 1;
+    const char *end = line + length;
+    while (message < end && *message == ' ') message++;
+    if (message == end) return false;
+
+    // skip to next line if action is bad
+    request->action = action_lookup(line, first_space);
+    if (request->action == ACTION_INVALID) return false;
+
+    request->message = message;
+    request->message_length = end - message;
+    return true;
+}
+
+/*
+Description:
+    Splits a buffer of input lines into requests in bulk. Newlines and spaces are located 64 bytes
+    at a time with the widest vector instructions the CPU supports (AVX2, SSE2, or a scalar
+    fallback, picked once at runtime), then every line is checked: empty lines, lines starting with
+    a space, lines without a message and lines with an unknown action are skipped. Safe to call from several threads at once.
+Arguments:
+    const char *data: The bytes to scan
+    size_t length: The number of bytes in data
+    int final: A true value if no more input follows, so a last line without a newline counts
+    Request *requests: Filled in with the requests found, pointing into data
+    size_t max_requests: The most requests to fill in
+    size_t *consumed: Set to the number of bytes of data that were fully scanned
+Return value:
+    Returns the number of requests filled in
+*/
+size_t scan_requests(const char *data, size_t length, int final, Request *requests,
+                     size_t max_requests, size_t *consumed) {
+
+    size_t count = 0;
+    size_t line_start = 0;
+    size_t first_space = NO_SPACE;
+    char tail[SCAN_BLOCK_SIZE];
+
+    pthread_once(&implementation_once, &select_implementation);
+
+    for (size_t base = 0; base < length && count < max_requests; base += SCAN_BLOCK_SIZE) {
+        const char *block = data + base;
+        uint64_t newlines;
+        uint64_t spaces;
+
+        // pad the last partial block with bytes that match nothing
+        if (length - base < SCAN_BLOCK_SIZE) {
+            memset(tail, 0, SCAN_BLOCK_SIZE);
+            memcpy(tail, block, length - base);
+            block = tail;
+        }
+        find_structurals(block, &newlines, &spaces);
+
+        while (count < max_requests) {
+            // the first space of the current line that falls in this block, if still needed
+            size_t space = NO_SPACE;
+            if (first_space == NO_SPACE && line_start < base + SCAN_BLOCK_SIZE) {
+                uint64_t candidates = spaces;
+                if (line_start > base) candidates &= ~0ULL << (line_start - base);
+                if (candidates) space = base + __builtin_ctzll(candidates);
+            }
+
+            if (!newlines) {
+                if (space != NO_SPACE) first_space = space;
+                break;
+            }
+
+            size_t newline = base + __builtin_ctzll(newlines);
+            newlines &= newlines - 1;
+            if (first_space == NO_SPACE && space < newline) first_space = space;
+
+            if (parse_line(data + line_start, newline - line_start,
+                           first_space == NO_SPACE ? NO_SPACE : first_space - line_start,
+                           &requests[count])) {
+                count++;
+            }
+            line_start = newline + 1;
+            first_space = NO_SPACE;
+        }
+    }
+
+    // last line has no newline
+    if (final && count < max_requests && line_start < length) {
+        if (parse_line(data + line_start, length - line_start,
+                       first_space == NO_SPACE ? NO_SPACE : first_space - line_start,
+                       &requests[count])) {
+            count++;
+        }
+        line_start = length;
+    }
+
+    *consumed = line_start;
+    return count;
+}
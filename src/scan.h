@@ -0,0 +1,37 @@
+#ifndef SCAN_H_
+#define SCAN_H_
+
+#include <stddef.h>
+
+#include "reader.h"
+
+/*
+Description:
+    Splits a buffer of input lines into requests in bulk. Newlines and spaces are located 64 bytes
+    at a time with the widest vector instructions the CPU supports (AVX2, SSE2, or a scalar
+    fallback, picked once at runtime), then every line is checked: empty lines, lines starting with
+    a space, lines without a message and lines with an unknown action are skipped. Safe to call from several threads at once.
+Arguments:
+    const char *data: The bytes to scan
+    size_t length: The number of bytes in data
+    int final: A true value if no more input follows, so a last line without a newline counts
+    Request *requests: Filled in with the requests found, pointing into data
+    size_t max_requests: The most requests to fill in
+    size_t *consumed: Set to the number of bytes of data that were fully scanned
+Return value:
+    Returns the number of requests filled in
+*/
+size_t scan_requests(const char *data, size_t length, int final, Request *requests,
+                     size_t max_requests, size_t *consumed);
+
+/*
+Description:
+    Gets the name of the scanner implementation chosen for this CPU.
+Arguments:
+    None
+Return value:
+    Returns "avx2", "sse2" or "scalar"
+*/
+const char *scan_implementation(void);
+
+#endif
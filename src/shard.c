@@ -0,0 +1,515 @@
+#include "log.h"
+#include "shard.h"
+
+#define INITIAL_QUEUE_CAPACITY 64
+
+/*
+Everything shard_deliver() needs to route one response: the shared reorder state and the
+connection the response arrived on.
+*/
+typedef struct ShardDelivery {
+    ReorderBuffer *reorder;
+    Connection *connection;
+    ResponseHandler handler;
+    void *context;
+} ShardDelivery;
+
+/*
+Description:
+    Appends a sequence number to the back of the queue, doubling its capacity when full.
+Arguments:
+    SequenceQueue *queue: The queue to append to
+    unsigned long sequence: The sequence number
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int sequence_push(SequenceQueue *queue, unsigned long sequence) {
+
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : INITIAL_QUEUE_CAPACITY;
+        unsigned long *sequences = malloc(sizeof(unsigned long) * capacity);
+        if (sequences == NULL) {
+            log_error("Failed to grow sequence queue\n");
+            return EXIT_FAILURE;
+        }
+        // unwrap the ring into the front of the new array
+        for (size_t i = 0; i < queue->count; i++) {
+            sequences[i] = queue->sequences[(queue->head + i) % queue->capacity];
+        }
+        free(queue->sequences);
+        queue->sequences = sequences;
+        queue->capacity = capacity;
+        queue->head = 0;
+    }
+
+    queue->sequences[(queue->head + queue->count) % queue->capacity] = sequence;
+    queue->count++;
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Removes the oldest sequence number from the queue. The queue must not be empty.
+Arguments:
+    SequenceQueue *queue: The queue to take from
+Return value:
+    Returns the oldest sequence number
+*/
+static unsigned long sequence_pop(SequenceQueue *queue) {
+    unsigned long sequence = queue->sequences[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    return sequence;
+}
+
+/*
+Description:
+    Makes sure the reorder buffer has a slot for sequence, growing it and moving the held responses
+    to their new slots if needed.
+Arguments:
+    ReorderBuffer *reorder: The reorder buffer
+    unsigned long sequence: The sequence number that needs a slot
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int reorder_reserve(ReorderBuffer *reorder, unsigned long sequence) {
+
+    if (sequence - reorder->next < reorder->capacity) return EXIT_SUCCESS;
+
+    size_t capacity = reorder->capacity ? reorder->capacity : INITIAL_QUEUE_CAPACITY;
+    while (sequence - reorder->next >= capacity) capacity *= 2;
+
+    char **messages = calloc(capacity, sizeof(char *));
+    size_t *lengths = calloc(capacity, sizeof(size_t));
+    if (messages == NULL || lengths == NULL) {
+        free(messages);
+        free(lengths);
+        log_error("Failed to grow reorder buffer\n");
+        return EXIT_FAILURE;
+    }
+
+    for (unsigned long held = reorder->next; held < reorder->next + reorder->capacity; held++) {
+        messages[held % capacity] = reorder->messages[held % reorder->capacity];
+        lengths[held % capacity] = reorder->lengths[held % reorder->capacity];
+    }
+    free(reorder->messages);
+    free(reorder->lengths);
+    reorder->messages = messages;
+    reorder->lengths = lengths;
+    reorder->capacity = capacity;
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Routes one response from a connection. If it is the next response in input order it is handed
+    to the caller's handler in place, followed by any held responses that are now in order;
+    otherwise it is copied into the reorder buffer.
+Arguments:
+    const char *data: The response
+    size_t length: The length of the response
+    void *context: The ShardDelivery for the connection the response arrived on
+Return value:
+    Always returns a false value; completion is tracked by shard_run()
+*/
+static int shard_deliver(const char *data, size_t length, void *context) {
+
+    ShardDelivery *delivery = context;
+    ReorderBuffer *reorder = delivery->reorder;
+
+    if (delivery->connection->pending.count == 0) {
+        log_error("Unexpected response, dropping it\n");
+        return false;
+    }
+    unsigned long sequence = sequence_pop(&delivery->connection->pending);
+
+    // arrived early, hold a copy until everything before it has been handed out
+    if (sequence != reorder->next) {
+        if (reorder_reserve(reorder, sequence)) exit(EXIT_FAILURE);
+        char *message = malloc(length + 1);
+        if (message == NULL) {
+            log_error("Failed to hold response\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(message, data, length);
+        message[length] = '\0';
+        reorder->messages[sequence % reorder->capacity] = message;
+        reorder->lengths[sequence % reorder->capacity] = length;
+        return false;
+    }
+
+    delivery->handler(data, length, delivery->context);
+    reorder->next++;
+
+    // hand out whatever was waiting on this one
+    while (reorder->capacity > 0 && reorder->messages[reorder->next % reorder->capacity] != NULL) {
+        size_t slot = reorder->next % reorder->capacity;
+        delivery->handler(reorder->messages[slot], reorder->lengths[slot], delivery->context);
+        free(reorder->messages[slot]);
+        reorder->messages[slot] = NULL;
+        reorder->next++;
+    }
+    return false;
+}
+
+/*
+Description:
+    Checks whether any open connection still owes a response.
+Arguments:
+    Shard *shard: The shard
+Return value:
+    Returns a true value if some open connection has requests outstanding, otherwise false
+*/
+static int shard_awaiting(Shard *shard) {
+    for (int i = 0; i < shard->count; i++) {
+        if (!shard->connections[i].closed && shard->connections[i].pending.count > 0) return true;
+    }
+    return false;
+}
+
+/*
+Description:
+    Picks the open connection with the fewest requests outstanding whose batch still has room,
+    starting the search after the last connection picked so ties go round-robin.
+Arguments:
+    Connection *connections: The connections
+    int count: The number of connections
+    int *last: The index of the last connection picked, updated by this function
+Return value:
+    Returns the connection to send on, or NULL if every batch is full
+*/
+static Connection *pick_connection(Connection *connections, int count, int *last) {
+
+    Connection *best = NULL;
+    int best_index = *last;
+
+    for (int i = 1; i <= count; i++) {
+        int index = (*last + i) % count;
+        Connection *connection = &connections[index];
+        if (connection->closed || tcp_client_batch_full(&connection->batch)) continue;
+        if (best == NULL || connection->pending.count < best->pending.count) {
+            best = connection;
+            best_index = index;
+        }
+    }
+    *last = best_index;
+    return best;
+}
+
+/*
+Description:
+    Starts connecting a connection to the first address from address onwards that accepts a
+    connection attempt, and registers it with the event loop.
+Arguments:
+    Connection *connection: The connection to connect
+    struct addrinfo *address: The first address to try
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int connection_start(Connection *connection, struct addrinfo *address) {
+
+    for (; address != NULL; address = address->ai_next) {
+        connection->sockfd = tcp_client_start_connect(address);
+        if (connection->sockfd != TCP_CLIENT_BAD_SOCKET) break;
+    }
+    if (address == NULL) {
+        log_error("Failed to connect\n");
+        return EXIT_FAILURE;
+    }
+
+    connection->address = address;
+    connection->connecting = 1;
+    connection->event.fd = connection->sockfd;
+    if (event_loop_add(&connection->shard->loop, &connection->event, EPOLLIN | EPOLLOUT)) {
+        log_error("Failed to watch connection\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Reacts to events on a connection: finishes connecting, flushes its batch when the socket is
+    writable and parses whatever responses have arrived.
+Arguments:
+    EventHandler *handler: The connection's event handler
+    uint32_t events: The epoll events that fired
+Return value:
+    None
+*/
+static void connection_ready(EventHandler *handler, uint32_t events) {
+
+    Connection *connection = (Connection *)handler;
+    Shard *shard = connection->shard;
+
+    if (connection->connecting) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(connection->sockfd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error == 0 && !(events & EPOLLERR)) {
+            connection->connecting = 0;
+        } else {
+            // try the next address before giving up
+            event_loop_remove(&shard->loop, &connection->event);
+            close(connection->sockfd);
+            connection->sockfd = TCP_CLIENT_BAD_SOCKET;
+            if (connection_start(connection, connection->address->ai_next)) {
+                connection->closed = 1;
+                shard->status = EXIT_FAILURE;
+                event_loop_stop(&shard->loop);
+            }
+            return;
+        }
+    }
+
+    if (events & EPOLLOUT) tcp_client_batch_flush(connection->sockfd, &connection->batch);
+
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+
+    int bytes_received = tcp_client_receive_into_buffer(connection->sockfd,
+                                                        &connection->responses);
+    if (bytes_received == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+        log_error("Receive failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    if (bytes_received == 0) {
+        log_info("Connection %ld closed.\n", (long)(connection - shard->connections));
+        connection->closed = 1;
+        event_loop_remove(&shard->loop, &connection->event);
+        // responses owed on this connection will never come, so order can't be kept
+        if (connection->pending.count > 0) {
+            log_error("Connection closed with %zu responses outstanding\n",
+                      connection->pending.count);
+            shard->status = EXIT_FAILURE;
+            event_loop_stop(&shard->loop);
+            return;
+        }
+        // held responses wait on earlier ones that no open connection owes anymore
+        if (shard->requests_sent > shard->reorder.next && !shard_awaiting(shard)) {
+            log_error("Connection closed with %lu responses held back\n",
+                      shard->requests_sent - shard->reorder.next);
+            shard->status = EXIT_FAILURE;
+            event_loop_stop(&shard->loop);
+        }
+        return;
+    }
+
+    ShardDelivery delivery = {&shard->reorder, connection, shard->handler, shard->context};
+    if (tcp_client_parse_responses(&connection->responses, &shard_deliver, &delivery, NULL) ==
+        TCP_CLIENT_PARSE_FAILED) {
+        shard->status = EXIT_FAILURE;
+        event_loop_stop(&shard->loop);
+    }
+}
+
+/*
+Description:
+    Notes that the input has more data, so the next tick reads from it again.
+Arguments:
+    EventHandler *handler: The shard's reader event handler
+    uint32_t events: The epoll events that fired
+Return value:
+    None
+*/
+static void reader_ready(EventHandler *handler, uint32_t events) {
+    (void)events;
+    Shard *shard = (Shard *)handler;
+    shard->reader_blocked = 0;
+    event_loop_watch(&shard->loop, &shard->reader_event, 0);
+}
+
+/*
+Description:
+    Runs before every wait: writes out output that has waited its interval, deals requests out to
+    the connections, decides which connections need to wait for writability, and stops the loop
+    once every response has been handed out.
+Arguments:
+    EventLoop *loop: The shard's event loop
+    void *context: The shard
+Return value:
+    None
+*/
+static void shard_tick(EventLoop *loop, void *context) {
+
+    Shard *shard = context;
+    Request request;
+
+    // wake up for buffered output that has waited out its interval, even if nothing arrives
+    if (output_expire(shard->config.output)) {
+        shard->status = EXIT_FAILURE;
+        event_loop_stop(loop);
+        return;
+    }
+    loop->timeout = output_timeout(shard->config.output);
+
+    // deal requests out while there is input left and room in the window
+    while (!shard->end_of_file && !shard->reader_blocked &&
+           (shard->config.window == 0 ||
+            shard->requests_sent - shard->reorder.next < (unsigned long)shard->config.window)) {
+        Connection *connection = pick_connection(shard->connections, shard->count, &shard->last);
+        if (connection == NULL) break;
+
+        int result = reader_next(shard->reader, &request);
+        if (result == READER_WOULD_BLOCK) {
+            shard->reader_blocked = 1;
+            event_loop_watch(loop, &shard->reader_event, EPOLLIN);
+            break;
+        }
+        if (result == -1) {
+            shard->end_of_file = 1;
+            break;
+        }
+        tcp_client_batch_add_request(&connection->batch, &request);
+        if (sequence_push(&connection->pending, shard->requests_sent++)) exit(EXIT_FAILURE);
+    }
+
+    // the file may have run out with nothing left in flight
+    if (shard->end_of_file && shard->reorder.next == shard->requests_sent) {
+        event_loop_stop(loop);
+        return;
+    }
+
+    int batches_drained = 1;
+    int open_connections = 0;
+    for (int i = 0; i < shard->count; i++) {
+        Connection *connection = &shard->connections[i];
+        if (connection->closed) continue;
+        open_connections++;
+        if (connection->batch.count > 0) batches_drained = 0;
+
+        // only wake up for writability when there is something to write
+        int want_write = connection->connecting || connection->batch.count > 0;
+        event_loop_watch(loop, &connection->event, EPOLLIN | (want_write ? EPOLLOUT : 0));
+    }
+
+    // no batch points into the reader anymore
+    if (batches_drained) reader_release(shard->reader);
+
+    if (open_connections == 0) {
+        log_error("All connections closed before every request was sent\n");
+        shard->status = EXIT_FAILURE;
+        event_loop_stop(loop);
+    }
+}
+
+/*
+Description:
+    Closes the connections and releases everything the shard holds.
+Arguments:
+    Shard *shard: The shard to free
+Return value:
+    None
+*/
+static void shard_free(Shard *shard) {
+    for (int i = 0; i < shard->count; i++) {
+        Connection *connection = &shard->connections[i];
+        tcp_client_batch_free(&connection->batch);
+        free(connection->responses.data);
+        free(connection->pending.sequences);
+        if (connection->sockfd != TCP_CLIENT_BAD_SOCKET) tcp_client_close(connection->sockfd);
+    }
+    free(shard->connections);
+    for (size_t i = 0; i < shard->reorder.capacity; i++) {
+        free(shard->reorder.messages[i]);
+    }
+    free(shard->reorder.messages);
+    free(shard->reorder.lengths);
+    if (shard->addresses != NULL) freeaddrinfo(shard->addresses);
+    event_loop_free(&shard->loop);
+}
+
+/*
+Description:
+    Opens config.connections non-blocking connections and spreads the requests read from the reader
+    over them, always picking the connection with the fewest requests outstanding. Responses are
+    handed to handler in the order the requests were read no matter which connection answered
+    first: responses that arrive early are copied into a reorder buffer, responses that arrive in
+    order are passed in place. If config.window is non-zero, reading pauses while that many
+    responses have not been handed out. Everything runs on one thread in an epoll event loop.
+Arguments:
+    RequestReader *reader: The reader to read requests from
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int shard_run(RequestReader *reader, Config config, ResponseHandler handler, void *context) {
+
+    Shard shard;
+    struct addrinfo hints;
+    int rv;
+
+    memset(&shard, 0, sizeof(Shard));
+    shard.config = config;
+    shard.count = config.connections;
+    shard.last = config.connections - 1;
+    shard.reader = reader;
+    shard.handler = handler;
+    shard.context = context;
+    shard.status = EXIT_SUCCESS;
+    shard.loop.epfd = -1;
+
+    shard.connections = calloc(shard.count, sizeof(Connection));
+    if (shard.connections == NULL) {
+        log_error("Failed to allocate connections\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < shard.count; i++) {
+        shard.connections[i].sockfd = TCP_CLIENT_BAD_SOCKET;
+    }
+
+    if (event_loop_init(&shard.loop)) {
+        shard_free(&shard);
+        return EXIT_FAILURE;
+    }
+
+    // resolve once for every connection
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(config.host, config.port, &hints, &shard.addresses)) != 0) {
+        log_error("%s\n", gai_strerror(rv));
+        shard_free(&shard);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < shard.count; i++) {
+        Connection *connection = &shard.connections[i];
+        connection->shard = &shard;
+        connection->event.callback = &connection_ready;
+        if (tcp_client_response_buffer_init(&connection->responses,
+                                            TCP_CLIENT_DEFAULT_BUFFER_SIZE) ||
+            tcp_client_batch_init(&connection->batch, config.batch_size,
+                                  config.flush_threshold) ||
+            connection_start(connection, shard.addresses)) {
+            log_error("Failed to set up connection %d\n", i);
+            shard_free(&shard);
+            return EXIT_FAILURE;
+        }
+        tcp_client_batch_use_file(&connection->batch, reader);
+    }
+
+    // input that can block is waited on like any socket; mapped files never block
+    shard.reader_event.callback = &reader_ready;
+    shard.reader_event.fd = reader_set_nonblocking(reader);
+    if (shard.reader_event.fd != -1 && event_loop_add(&shard.loop, &shard.reader_event, 0)) {
+        // regular files can't be watched, but reading them doesn't block either
+        log_debug("Input can't be watched, reading it directly\n");
+        shard.reader_event.fd = -1;
+    }
+
+    if (event_loop_run(&shard.loop, &shard_tick, &shard)) shard.status = EXIT_FAILURE;
+
+    // whatever is still held would otherwise be freed without ever being written
+    if (shard.status == EXIT_SUCCESS && shard.reorder.next != shard.requests_sent) {
+        log_error("Only %lu of %lu responses were handed out\n", shard.reorder.next,
+                  shard.requests_sent);
+        shard.status = EXIT_FAILURE;
+    }
+
+    int status = shard.status;
+    shard_free(&shard);
+    return status;
+}
@@ -0,0 +1,89 @@
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include "event_loop.h"
+#include "tcp_client.h"
+
+/*
+The sequence numbers of the requests sent on one connection that are still waiting for a response,
+oldest first. The server answers a connection's requests in order, so the head is always the
+request the next response belongs to.
+*/
+typedef struct SequenceQueue {
+    unsigned long *sequences;
+    size_t capacity;
+    size_t head;
+    size_t count;
+} SequenceQueue;
+
+/*
+One lane to the server with its own send batch, parse state and outstanding requests. event must
+stay the first member so the event loop's handler can be cast back to the connection. While
+connecting is set, address is the address being tried; the next one is tried if it fails.
+*/
+typedef struct Connection {
+    EventHandler event;
+    struct Shard *shard;
+    int sockfd;
+    int connecting;
+    int closed;
+    struct addrinfo *address;
+    RequestBatch batch;
+    ResponseBuffer responses;
+    SequenceQueue pending;
+} Connection;
+
+/*
+Holds responses that arrived before an earlier request's response so they can be handed out in the
+original input order. Slot seq % capacity holds the response for seq; next is the sequence number
+that will be handed out next.
+*/
+typedef struct ReorderBuffer {
+    char **messages;
+    size_t *lengths;
+    size_t capacity;
+    unsigned long next;
+} ReorderBuffer;
+
+/*
+Everything one run over many connections needs. All of it is driven from one thread by an epoll
+event loop: connects, sends, receives and, when the input can block (stdin), reads too. reader_event
+must stay the first member so the reader's handler can be cast back to the shard.
+*/
+typedef struct Shard {
+    EventHandler reader_event;
+    EventLoop loop;
+    Config config;
+    struct addrinfo *addresses;
+    Connection *connections;
+    int count;
+    int last;
+    RequestReader *reader;
+    int reader_blocked;
+    int end_of_file;
+    unsigned long requests_sent;
+    ReorderBuffer reorder;
+    ResponseHandler handler;
+    void *context;
+    int status;
+} Shard;
+
+/*
+Description:
+    Opens config.connections non-blocking connections and spreads the requests read from the reader
+    over them, always picking the connection with the fewest requests outstanding. Responses are
+    handed to handler in the order the requests were read no matter which connection answered
+    first: responses that arrive early are copied into a reorder buffer, responses that arrive in
+    order are passed in place. If config.window is non-zero, reading pauses while that many
+    responses have not been handed out. Everything runs on one thread in an epoll event loop.
+Arguments:
+    RequestReader *reader: The reader to read requests from
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int shard_run(RequestReader *reader, Config config, ResponseHandler handler, void *context);
+
+#endif
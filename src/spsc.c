@@ -0,0 +1,106 @@
+#include <stdlib.h>
+
+#include "log.h"
+#include "spsc.h"
+
+/*
+Description:
+    Prepares an empty ring.
+Arguments:
+    SpscRing *ring: The ring to initialize
+    size_t capacity: The most requests the ring holds, rounded up to a power of two
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int spsc_init(SpscRing *ring, size_t capacity) {
+
+    size_t size = 1;
+    while (size < capacity) size *= 2;
+
+    ring->slots = malloc(sizeof(Request) * size);
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    if (ring->slots == NULL) {
+        log_error("Failed to allocate request ring\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Appends a request. Only the producer thread may call this.
+Arguments:
+    SpscRing *ring: The ring
+    const Request *request: The request to append
+Return value:
+    Returns a true value if the request was appended, false if the ring is full
+*/
+int spsc_push(SpscRing *ring, const Request *request) {
+    size_t tail = ring->tail;
+
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask) return false;
+
+    ring->slots[tail & ring->mask] = *request;
+    // the slot must be written before the consumer can see it
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+Description:
+    Removes the oldest request. Only the consumer thread may call this.
+Arguments:
+    SpscRing *ring: The ring
+    Request *request: Filled in with the request removed
+Return value:
+    Returns a true value if a request was removed, false if the ring is empty
+*/
+int spsc_pop(SpscRing *ring, Request *request) {
+    size_t head = ring->head;
+
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) return false;
+
+    *request = ring->slots[head & ring->mask];
+    // the slot must be read before the producer can reuse it
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+Description:
+    Checks if the ring is full. Meant for the producer deciding whether to wait.
+Arguments:
+    SpscRing *ring: The ring
+Return value:
+    Returns a true value if the ring is full, otherwise false
+*/
+int spsc_full(SpscRing *ring) {
+    return ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask;
+}
+
+/*
+Description:
+    Checks if the ring is empty. Meant for the consumer deciding whether to wait.
+Arguments:
+    SpscRing *ring: The ring
+Return value:
+    Returns a true value if the ring is empty, otherwise false
+*/
+int spsc_empty(SpscRing *ring) {
+    return ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/*
+Description:
+    Releases the ring's slots.
+Arguments:
+    SpscRing *ring: The ring to free
+Return value:
+    None
+*/
+void spsc_free(SpscRing *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+}
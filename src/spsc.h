@@ -0,0 +1,89 @@
+#ifndef SPSC_H_
+#define SPSC_H_
+
+#include <stddef.h>
+
+#include "reader.h"
+
+#define SPSC_CACHE_LINE 64
+
+/*
+A bounded lock-free queue of requests between exactly one producer thread and one consumer thread.
+The producer only writes tail and the consumer only writes head, each on its own cache line, so
+neither side ever waits on a lock or bounces the other's line on every operation. capacity is a
+power of two so positions wrap with a mask.
+*/
+typedef struct SpscRing {
+    Request *slots;
+    size_t mask;
+    char pad0[SPSC_CACHE_LINE];
+    size_t head;
+    char pad1[SPSC_CACHE_LINE - sizeof(size_t)];
+    size_t tail;
+    char pad2[SPSC_CACHE_LINE - sizeof(size_t)];
+} SpscRing;
+
+/*
+Description:
+    Prepares an empty ring.
+Arguments:
+    SpscRing *ring: The ring to initialize
+    size_t capacity: The most requests the ring holds, rounded up to a power of two
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int spsc_init(SpscRing *ring, size_t capacity);
+
+/*
+Description:
+    Appends a request. Only the producer thread may call this.
+Arguments:
+    SpscRing *ring: The ring
+    const Request *request: The request to append
+Return value:
+    Returns a true value if the request was appended, false if the ring is full
+*/
+int spsc_push(SpscRing *ring, const Request *request);
+
+/*
+Description:
+    Removes the oldest request. Only the consumer thread may call this.
+Arguments:
+    SpscRing *ring: The ring
+    Request *request: Filled in with the request removed
+Return value:
+    Returns a true value if a request was removed, false if the ring is empty
+*/
+int spsc_pop(SpscRing *ring, Request *request);
+
+/*
+Description:
+    Checks if the ring is full. Meant for the producer deciding whether to wait.
+Arguments:
+    SpscRing *ring: The ring
+Return value:
+    Returns a true value if the ring is full, otherwise false
+*/
+int spsc_full(SpscRing *ring);
+
+/*
+Description:
+    Checks if the ring is empty. Meant for the consumer deciding whether to wait.
+Arguments:
+    SpscRing *ring: The ring
+Return value:
+    Returns a true value if the ring is empty, otherwise false
+*/
+int spsc_empty(SpscRing *ring);
+
+/*
+Description:
+    Releases the ring's slots.
+Arguments:
+    SpscRing *ring: The ring to free
+Return value:
+    None
+*/
+void spsc_free(SpscRing *ring);
+
+#endif
@@ -0,0 +1,205 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "stats.h"
+
+static Stats slots[STATS_MAX_THREADS];
+static int slot_count = 0;
+static long dump_interval = 0;
+
+__thread Stats *stats_local = NULL;
+int stats_enabled = 0;
+
+/*
+Description:
+    Gives the calling thread a Stats slot of its own. Threads past STATS_MAX_THREADS share the last
+    slot, so their counts may lose increments.
+Arguments:
+    None
+Return value:
+    Returns the calling thread's counters
+*/
+Stats *stats_register(void) {
+    int slot = __atomic_fetch_add(&slot_count, 1, __ATOMIC_RELAXED);
+    if (slot >= STATS_MAX_THREADS) slot = STATS_MAX_THREADS - 1;
+    stats_local = &slots[slot];
+    return stats_local;
+}
+
+/*
+Description:
+    Counts one send and the bytes it wrote.
+Arguments:
+    size_t size: The number of bytes sent
+Return value:
+    None
+*/
+void stats_sent(size_t size) {
+    STATS_ADD(sends, 1);
+    STATS_ADD(bytes_sent, size);
+}
+
+/*
+Description:
+    Counts one receive of the given size, in bytes and in the receive size histogram.
+Arguments:
+    size_t size: The number of bytes received
+Return value:
+    None
+*/
+void stats_received(size_t size) {
+    int bucket = size > 0 ? 63 - __builtin_clzll(size) : 0;
+    if (bucket >= STATS_RECV_BUCKETS) bucket = STATS_RECV_BUCKETS - 1;
+
+    STATS_ADD(receives, 1);
+    STATS_ADD(bytes_received, size);
+    STATS_ADD(recv_sizes[bucket], 1);
+}
+
+/*
+Description:
+    Sums every thread's counters.
+Arguments:
+    Stats *total: Filled in with the sums
+Return value:
+    None
+*/
+void stats_collect(Stats *total) {
+
+    int count = __atomic_load_n(&slot_count, __ATOMIC_RELAXED);
+    if (count > STATS_MAX_THREADS) count = STATS_MAX_THREADS;
+
+    // every field is a uint64_t, so the struct can be summed as an array
+    uint64_t *sums = (uint64_t *)total;
+    size_t fields = offsetof(Stats, handle_ns) / sizeof(uint64_t) + 1;
+
+    memset(total, 0, sizeof(Stats));
+    for (int i = 0; i < count; i++) {
+        uint64_t *counters = (uint64_t *)&slots[i];
+        for (size_t j = 0; j < fields; j++) {
+            sums[j] += __atomic_load_n(&counters[j], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+Description:
+    Writes the summed counters as one line of key=value pairs.
+Arguments:
+    FILE *file: Where to write them
+Return value:
+    None
+*/
+void stats_dump(FILE *file) {
+
+    Stats total;
+    stats_collect(&total);
+
+    fprintf(file, "stats: bytes_sent=%" PRIu64 " bytes_received=%" PRIu64 " syscalls=%" PRIu64
+            " sends=%" PRIu64 " receives=%" PRIu64 " recv_sizes=",
+            total.bytes_sent, total.bytes_received, total.syscalls, total.sends, total.receives);
+
+    // only the buckets that were hit, as lower_bound:count
+    const char *separator = "";
+    for (int i = 0; i < STATS_RECV_BUCKETS; i++) {
+        if (total.recv_sizes[i] == 0) continue;
+        fprintf(file, "%s%llu:%" PRIu64, separator, 1ULL << i, total.recv_sizes[i]);
+        separator = ",";
+    }
+    if (*separator == '\0') fprintf(file, "none");
+
+    fprintf(file, " buffer_grows=%" PRIu64 " requests_sent=%" PRIu64 " responses_received=%" PRIu64
+            " in_flight=%" PRId64 " handle_ms=%.3f\n",
+            total.buffer_grows, total.requests_sent, total.responses_received,
+            (int64_t)(total.requests_sent - total.responses_received), total.handle_ns / 1e6);
+    fflush(file);
+}
+
+/*
+Description:
+    Dumps the counters at exit.
+Arguments:
+    None
+Return value:
+    None
+*/
+static void dump_at_exit(void) {
+    stats_dump(stderr);
+}
+
+/*
+Description:
+    Dumps the counters on SIGUSR1 and every dump_interval milliseconds. Runs on its own thread.
+Arguments:
+    void *argument: Unused
+Return value:
+    Never returns
+*/
+static void *dump_loop(void *argument) {
+
+    sigset_t signals;
+    (void)argument;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    while (1) {
+        int signal_number;
+        if (dump_interval > 0) {
+            struct timespec timeout = {dump_interval / 1000, (dump_interval % 1000) * 1000000};
+            signal_number = sigtimedwait(&signals, NULL, &timeout);
+            if (signal_number == -1 && errno != EAGAIN) continue;
+        } else {
+            signal_number = sigwaitinfo(&signals, NULL);
+            if (signal_number == -1) continue;
+        }
+        stats_dump(stderr);
+    }
+    return NULL;
+}
+
+/*
+Description:
+    Unless interval is negative, sets stats_enabled and starts a thread that dumps the counters to
+    stderr whenever the process gets SIGUSR1 and, if interval is positive, every interval
+    milliseconds and at exit. SIGUSR1 is then blocked in the calling thread, so this must be called
+    before any other thread is started for them to inherit that. With a negative interval nothing
+    is started and SIGUSR1 keeps its default action.
+Arguments:
+    long interval: Milliseconds between dumps, 0 to only dump on SIGUSR1, or a negative value to
+        never dump
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int stats_start(long interval) {
+
+    sigset_t signals;
+    pthread_t thread;
+
+    if (interval < 0) return EXIT_SUCCESS;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL)) {
+        log_error("Failed to block SIGUSR1\n");
+        return EXIT_FAILURE;
+    }
+
+    dump_interval = interval;
+    if (pthread_create(&thread, NULL, &dump_loop, NULL)) {
+        log_error("Failed to start stats thread\n");
+        return EXIT_FAILURE;
+    }
+    pthread_detach(thread);
+
+    stats_enabled = 1;
+    if (interval > 0) atexit(&dump_at_exit);
+    return EXIT_SUCCESS;
+}
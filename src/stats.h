@@ -0,0 +1,120 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define STATS_MAX_THREADS 256
+#define STATS_RECV_BUCKETS 24
+#define STATS_CACHE_LINE 64
+
+/*
+Counters for one thread. Each thread only ever writes its own, which sits on cache lines of its own,
+so counting is a plain add that never bounces a line between cores. Readers on other threads may
+see a count a few increments old, which is fine for a periodic dump. recv_sizes[i] counts receives
+of 2^i to 2^(i+1) - 1 bytes, the last bucket taking everything larger.
+*/
+typedef struct Stats {
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t syscalls;
+    uint64_t sends;
+    uint64_t receives;
+    uint64_t recv_sizes[STATS_RECV_BUCKETS];
+    uint64_t buffer_grows;
+    uint64_t requests_sent;
+    uint64_t responses_received;
+    uint64_t handle_ns;
+} __attribute__((aligned(STATS_CACHE_LINE))) Stats;
+
+extern __thread Stats *stats_local;
+
+// set by stats_start() when the counters will be printed, so costly measurements can be skipped
+extern int stats_enabled;
+
+/*
+Description:
+    Gives the calling thread a Stats slot of its own. Threads past STATS_MAX_THREADS share the last
+    slot, so their counts may lose increments.
+Arguments:
+    None
+Return value:
+    Returns the calling thread's counters
+*/
+Stats *stats_register(void);
+
+/*
+Description:
+    Finds the calling thread's counters, registering it the first time.
+Arguments:
+    None
+Return value:
+    Returns the calling thread's counters
+*/
+static inline Stats *stats_get(void) {
+    return stats_local != NULL ? stats_local : stats_register();
+}
+
+// adds to a counter of the calling thread; the store is atomic so a dump never sees a torn value
+#define STATS_ADD(field, amount)                                                     \
+    do {                                                                             \
+        Stats *stats_ = stats_get();                                                 \
+        __atomic_store_n(&stats_->field, stats_->field + (amount), __ATOMIC_RELAXED); \
+    } while (0)
+
+/*
+Description:
+    Counts one send and the bytes it wrote.
+Arguments:
+    size_t size: The number of bytes sent
+Return value:
+    None
+*/
+void stats_sent(size_t size);
+
+/*
+Description:
+    Counts one receive of the given size, in bytes and in the receive size histogram.
+Arguments:
+    size_t size: The number of bytes received
+Return value:
+    None
+*/
+void stats_received(size_t size);
+
+/*
+Description:
+    Sums every thread's counters.
+Arguments:
+    Stats *total: Filled in with the sums
+Return value:
+    None
+*/
+void stats_collect(Stats *total);
+
+/*
+Description:
+    Writes the summed counters as one line of key=value pairs.
+Arguments:
+    FILE *file: Where to write them
+Return value:
+    None
+*/
+void stats_dump(FILE *file);
+
+/*
+Description:
+    Unless interval is negative, sets stats_enabled and starts a thread that dumps the counters to
+    stderr whenever the process gets SIGUSR1 and, if interval is positive, every interval
+    milliseconds and at exit. SIGUSR1 is then blocked in the calling thread, so this must be called
+    before any other thread is started for them to inherit that. With a negative interval nothing
+    is started and SIGUSR1 keeps its default action.
+Arguments:
+    long interval: Milliseconds between dumps, 0 to only dump on SIGUSR1, or a negative value to
+        never dump
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int stats_start(long interval);
+
+#endif
@@ -1,15 +1,23 @@
 #include "log.h"
+#include "stats.h"
 #include "tcp_client.h"
 #include "ctype.h"
 
 #define REQUIRED_NUMBER_OF_ARGUMENTS_OFFSET 1
 #define ALL_OPTIONS_PARSED -1
-#define NUMBER_OF_ACTIONS 5
-#define PAYLOAD_MEMORY_BUFFER 10
-#define DEFAULT_BUFFER_SIZE 1024
-#define SHORT_OPTIONS "vh:p:"
+#define BATCH_HEADER_SIZE 16
+#define IOVECS_PER_REQUEST 3
+#define ZEROCOPY_DRAIN_TIMEOUT 1000
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#define SHORT_OPTIONS "vdush:zlp:w:b:f:c:t:i:S:r:n:I:"
 #define HELP_MESSAGE "\n\
-    Usage: tcp_client [--help] [-v] [-h HOST] [-p PORT] FILE\n\
+    Usage: tcp_client [--help] [-v] [-d] [-u] [-s] [-z] [-l] [-w N] [-b N] [-f BYTES]\n\
+                      [-c N] [-t N] [-i MS] [-S BYTES] [-r RATE] [-n N]\n\
+                      [-I MS]\n\
+                      [-h HOST] [-p PORT]\n\
+                      FILE\n\
     \n\
     Arguments:\n\
     FILE   A file name containing actions and messages to\n\
@@ -19,9 +27,70 @@
     Options:\n\
     --help\n\
     -v, --verbose\n\
+    -d, --duplex   Receive responses while requests are still being sent\n\
+    -u, --io-uring Send and receive through io_uring where the kernel\n\
+           supports it (implies --duplex, one connection only)\n\
+    -s, --split    Read FILE on its own thread, handing requests to\n\
+           the network thread through a lock-free ring\n\
+           (implies --duplex, one connection only)\n\
+    -z, --zerocopy Send large batches with MSG_ZEROCOPY (implies\n\
+           --duplex; ignored with -u, -s, -c and -r)\n\
+    -l, --latency-report\n\
+           Print a histogram of round-trip times to stderr at\n\
+           exit (one connection only)\n\
+    --window N, -w N\n\
+           Pause reading FILE while N requests await a response\n\
+           (implies --duplex)\n\
+    --batch N, -b N\n\
+           Send up to N requests per writev() (default 64)\n\
+    --flush-threshold BYTES, -f BYTES\n\
+           Flush a batch once BYTES are pending (default 65536)\n\
+    --connections N, -c N\n\
+           Spread requests over N connections, keeping output\n\
+           in input order (implies --duplex)\n\
+    --threads N, -t N\n\
+           Run the input in chunks on N threads, each with its\n\
+           own connection, keeping output in input order\n\
+    --output-interval MS, -i MS\n\
+           Write buffered responses out once the oldest has\n\
+           waited MS milliseconds (default: when 256 KiB fill)\n\
+    --stream BYTES, -S BYTES\n\
+           Pass responses longer than BYTES through as they\n\
+           arrive instead of buffering them whole (default\n\
+           1048576, 0 streams everything; ignored with -c\n\
+           and -t)\n\
+    --rate RATE, -r RATE\n\
+           Send RATE requests per second on a fixed schedule,\n\
+           whatever the responses do, and report latency from\n\
+           when each was due (implies --latency-report, one\n\
+           connection only)\n\
+    --requests N, -n N\n\
+           With --rate, send N requests, reading FILE again\n\
+           from the top as often as needed (default: once)\n\
+    --stats-interval MS, -I MS\n\
+           Print I/O counters to stderr every MS milliseconds\n\
+           and at exit (0: only on SIGUSR1); SIGUSR1 prints\n\
+           them at any time, but only when -I is given\n\
     --host HOSTNAME, -h HOSTNAME\n\
     --port PORT, -p PORT\n"
 
+/*
+Description:
+    Checks if a string is a non-empty run of digits.
+Arguments:
+    char *string: The string to check
+Return value:
+    Returns a true value if the string is a number, otherwise false
+*/
+static int is_number(char *string) {
+    if (*string == '\0') return false;
+    // loop through input and check each char is a digit
+    for (size_t i = 0; i < strlen(string); i++) {
+        if (!isdigit(string[i])) return false;
+    }
+    return true;
+}
+
 /*
 Description:
     Parses the commandline arguments and options given to the program.
@@ -43,16 +112,49 @@ int tcp_client_parse_arguments(int argc, char *argv[], Config *config) {
     // set default port and host
     config->port = TCP_CLIENT_DEFAULT_PORT;
     config->host = TCP_CLIENT_DEFAULT_HOST;
+    config->duplex = 0;
+    config->window = 0;
+    config->batch_size = TCP_CLIENT_DEFAULT_BATCH_SIZE;
+    config->flush_threshold = TCP_CLIENT_DEFAULT_FLUSH_THRESHOLD;
+    config->connections = 1;
+    config->io_uring = 0;
+    config->threads = 1;
+    config->split = 0;
+    config->output_interval = -1;
+    config->output = NULL;
+    config->stream_threshold = TCP_CLIENT_DEFAULT_STREAM_THRESHOLD;
+    config->zerocopy = 0;
+    config->latency_report = 0;
+    config->latency = NULL;
+    config->rate = 0;
+    config->requests = 0;
+    config->stats_interval = -1;
 
     static struct option long_options[] = {
         {"help", no_argument, 0, 0},
         {"verbose", no_argument, 0, 'v'},
+        {"duplex", no_argument, 0, 'd'},
+        {"io-uring", no_argument, 0, 'u'},
+        {"split", no_argument, 0, 's'},
+        {"zerocopy", no_argument, 0, 'z'},
+        {"latency-report", no_argument, 0, 'l'},
+        {"rate", required_argument, 0, 'r'},
+        {"requests", required_argument, 0, 'n'},
+        {"stats-interval", required_argument, 0, 'I'},
+        {"window", required_argument, 0, 'w'},
+        {"batch", required_argument, 0, 'b'},
+        {"flush-threshold", required_argument, 0, 'f'},
+        {"connections", required_argument, 0, 'c'},
+        {"threads", required_argument, 0, 't'},
+        {"output-interval", required_argument, 0, 'i'},
+        {"stream", required_argument, 0, 'S'},
         {"host", required_argument, 0, 'h'},
         {"port", required_argument, 0, 'p'},
         {0, 0, 0, 0}
     };
     
     int getopt_return_value;
+    int stream_given = 0;
 
     while (1) {
         int option_index = 0;
@@ -72,20 +174,149 @@ int tcp_client_parse_arguments(int argc, char *argv[], Config *config) {
             log_set_level(LOG_TRACE);
             break;
 
+        case 'd':
+            config->duplex = 1;
+            log_info("Duplex is ON\n");
+            break;
+
+        case 'u':
+            config->io_uring = 1;
+            config->duplex = 1;
+            log_info("io_uring is ON\n");
+            break;
+
+        case 's':
+            config->split = 1;
+            config->duplex = 1;
+            log_info("Split reader is ON\n");
+            break;
+
+        case 'z':
+            config->zerocopy = 1;
+            config->duplex = 1;
+            log_info("Zerocopy is ON\n");
+            break;
+
+        case 'l':
+            config->latency_report = 1;
+            log_info("Latency report is ON\n");
+            break;
+
+        case 'r':
+            if (!is_number(optarg) || atol(optarg) == 0) {
+                log_error("'%s' is not a valid rate\n", optarg);
+                printf(HELP_MESSAGE);
+                exit(EXIT_FAILURE);
+            }
+            config->rate = atol(optarg);
+            config->latency_report = 1;
+            log_info("Rate is set to %ld requests per second\n", config->rate);
+            break;
+
+        case 'n':
+            if (!is_number(optarg) || atol(optarg) == 0) {
+                log_error("'%s' is not a valid number of requests\n", optarg);
+                printf(HELP_MESSAGE);
+                exit(EXIT_FAILURE);
+            }
+            config->requests = strtoul(optarg, NULL, 10);
+            log_info("Requests is set to %lu\n", config->requests);
+            break;
+
+        case 'I':
+            if (!is_number(optarg)) {
+                log_error("'%s' is not a valid stats interval\n", optarg);
+                printf(HELP_MESSAGE);
+                exit(EXIT_FAILURE);
+            }
+            config->stats_interval = atol(optarg);
+            log_info("Stats interval is set to '%s'\n", optarg);
+            break;
+
+        case 'w':
+            if (!is_number(optarg)) {
+                log_error("'%s' is not a valid window\n", optarg);
+                printf(HELP_MESSAGE);
+                exit(EXIT_FAILURE);
+            }
+            config->window = atoi(optarg);
+            config->duplex = 1;
+            log_info("Window is set to '%s'\n", optarg);
+            break;
+
         case 'h':
             config->host = optarg;
             log_info("Host is set to '%s'\n", optarg);
             break;
 
+        case 'b':
+            if (!is_number(optarg) || atoi(optarg) == 0) {
+                log_error("'%s' is not a valid batch size\n", optarg);
+                printf(HELP_MESSAGE);
+                exit(EXIT_FAILURE);
+            }
+            config->batch_size = atoi(optarg);
+            log_info("Batch size is set to '%s'\n", optarg);
+            break;
+
+        case 'f':
+            if (!is_number(optarg) || atoi(optarg) == 0) {
+                log_error("'%s' is not a valid flush threshold\n", optarg);
+                printf(HELP_MESSAGE);
+                exit(EXIT_FAILURE);
+            }
+            config->flush_threshold = atoi(optarg);
+            log_info("Flush threshold is set to '%s'\n", optarg);
+            break;
+
+        case 'c':
+            if (!is_number(optarg) || atoi(optarg) == 0) {
+                log_error("'%s' is not a valid connection count\n", optarg);
+                printf(HELP_MESSAGE);
+                exit(EXIT_FAILURE);
+            }
+            config->connections = atoi(optarg);
+            config->duplex = 1;
+            log_info("Connections is set to '%s'\n", optarg);
+            break;
+
+        case 't':
+            if (!is_number(optarg) || atoi(optarg) == 0) {
+                log_error("'%s' is not a valid thread count\n", optarg);
+                printf(HELP_MESSAGE);
+                exit(EXIT_FAILURE);
+            }
+            config->threads = atoi(optarg);
+            config->duplex = 1;
+            log_info("Threads is set to '%s'\n", optarg);
+            break;
+
+        case 'i':
+            if (!is_number(optarg)) {
+                log_error("'%s' is not a valid output interval\n", optarg);
+                printf(HELP_MESSAGE);
+                exit(EXIT_FAILURE);
+            }
+            config->output_interval = atol(optarg);
+            log_info("Output interval is set to '%s'\n", optarg);
+            break;
+
+        case 'S':
+            if (!is_number(optarg)) {
+                log_error("'%s' is not a valid stream threshold\n", optarg);
+                printf(HELP_MESSAGE);
+                exit(EXIT_FAILURE);
+            }
+            config->stream_threshold = strtoul(optarg, NULL, 10);
+            stream_given = 1;
+            log_info("Stream threshold is set to '%s'\n", optarg);
+            break;
+
         case 'p':
-            // loop through input port number
-            for (size_t i = 0; i < strlen(optarg); i++) {
-                // check if input is digit
-                if (!isdigit(optarg[i])) {
-                    log_error("'%s' is not a valid port\n", optarg);
-                    printf(HELP_MESSAGE);
-                    exit(EXIT_FAILURE);
-                }
+            if (!is_number(optarg)) {
+                log_error("'%s' is not a valid port\n", optarg);
+                printf(HELP_MESSAGE);
+                exit(EXIT_FAILURE);
             }
             config->port = optarg;
             log_info("Port is set to '%s'\n", optarg);
@@ -117,12 +348,25 @@ int tcp_client_parse_arguments(int argc, char *argv[], Config *config) {
 
     // set file
     config->file = argv[argc - 1];
+
+    // zerocopy is set up by tcp_client_duplex_init(), which only the duplex and -t loops call
+    if (config->zerocopy &&
+        (config->io_uring || config->split || config->connections > 1 || config->rate)) {
+        log_warn("--zerocopy doesn't work with --io-uring, --split, --connections or --rate, "
+                 "ignoring it\n");
+        config->zerocopy = 0;
+    }
+    // the rate loop runs alone, so it streams whatever else was asked for
+    if (stream_given && !config->rate && (config->threads > 1 || config->connections > 1)) {
+        log_warn("--stream only works on one connection, ignoring it\n");
+    }
     
     // for debug
     if (optind < argc) {
         log_debug("non-option ARGV-elements: ");
-        while (optind < argc)
-            log_debug("%s ", argv[optind++]);
+        for (int i = optind; i < argc; i++) {
+            log_debug("%s ", argv[i]);
+        }
         log_debug("\n");
     }
 
@@ -181,46 +425,772 @@ int tcp_client_connect(Config config) {
 
 /*
 Description:
-    Creates and sends request to server using the socket and configuration.
+    Starts connecting a non-blocking TCP socket to one resolved address. The connection finishes in
+    the background; the socket becomes writable once it has, and SO_ERROR tells whether it worked.
+Arguments:
+    struct addrinfo *address: The address to connect to
+Return value:
+    Returns the socket file descriptor or -1 if an error occurs.
+*/
+int tcp_client_start_connect(struct addrinfo *address) {
+
+    int sockfd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (sockfd == -1) return TCP_CLIENT_BAD_SOCKET;
+
+    if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+        (connect(sockfd, address->ai_addr, address->ai_addrlen) == -1 && errno != EINPROGRESS)) {
+        close(sockfd);
+        return TCP_CLIENT_BAD_SOCKET;
+    }
+    return sockfd;
+}
+
+/*
+Description:
+    Skips the iovecs that were written whole and trims the one that was written partially.
+Arguments:
+    struct iovec *iov: The iovecs that were written
+    int iov_count: The number of iovecs
+    int *iov_sent: The index of the first iovec not fully written, advanced by this function
+    size_t bytes_sent: The number of bytes written starting at *iov_sent
+Return value:
+    None
+*/
+static void advance_iovecs(struct iovec *iov, int iov_count, int *iov_sent, size_t bytes_sent) {
+    while (*iov_sent < iov_count && bytes_sent >= iov[*iov_sent].iov_len) {
+        bytes_sent -= iov[*iov_sent].iov_len;
+        (*iov_sent)++;
+    }
+    if (bytes_sent > 0) {
+        iov[*iov_sent].iov_base = (char *)iov[*iov_sent].iov_base + bytes_sent;
+        iov[*iov_sent].iov_len -= bytes_sent;
+    }
+}
+
+/*
+Description:
+    Writes iovecs with writev() starting at *iov_sent, trimming the iovec that was only partially
+    written so the next call picks up where this one stopped. On a blocking socket this returns once
+    everything is written; on a non-blocking socket it returns when the socket stops accepting data.
 Arguments:
     int sockfd: Socket file descriptor
-    char *action: The action that will be sent
-    char *message: The message that will be sent
+    struct iovec *iov: The iovecs to write
+    int iov_count: The number of iovecs
+    int *iov_sent: The index of the first iovec not fully written, advanced by this function
 Return value:
-    Returns a 1 on failure, 0 on success
+    Returns the number of bytes written
 */
-int tcp_client_send_request(int sockfd, char *action, char *message) {
-    
-    int message_length = strlen(message);
-    int bytes_sent = 0;
-    int total_bytes_sent = 0;
+static size_t write_iovecs(int sockfd, struct iovec *iov, int iov_count, int *iov_sent) {
 
-    int payload_length = strlen(action) + strlen(message) + PAYLOAD_MEMORY_BUFFER;
-    
-    char *request = (char *)malloc(payload_length);
-    sprintf(request, "%s %d %s", action, message_length, message);
-    int request_length = strlen(request);
-    
-    // send until all message is sent
-    while (total_bytes_sent < request_length) {
-        bytes_sent = send(sockfd, request, request_length - total_bytes_sent, 0);
+    size_t total_bytes_sent = 0;
+
+    while (*iov_sent < iov_count) {
+        int batch_count = iov_count - *iov_sent < IOV_MAX ? iov_count - *iov_sent : IOV_MAX;
+        ssize_t bytes_sent = writev(sockfd, iov + *iov_sent, batch_count);
+        STATS_ADD(syscalls, 1);
         // check if an error has occurred
         if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
             log_error("Send failed!\n");
             exit(EXIT_FAILURE);
         }
+        stats_sent(bytes_sent);
+        total_bytes_sent += bytes_sent;
+        advance_iovecs(iov, iov_count, iov_sent, bytes_sent);
+    }
+    return total_bytes_sent;
+}
+
+/*
+Description:
+    Prepares an empty request batch.
+Arguments:
+    RequestBatch *batch: The batch to initialize
+    int batch_size: The most requests the batch will hold before it must be flushed
+    int flush_threshold: The number of pending bytes at which the batch is considered full
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_batch_init(RequestBatch *batch, int batch_size, int flush_threshold) {
+
+    // a single writev() can't take more than IOV_MAX iovecs
+    if (batch_size > IOV_MAX / IOVECS_PER_REQUEST) batch_size = IOV_MAX / IOVECS_PER_REQUEST;
+
+    batch->iov = malloc(sizeof(struct iovec) * batch_size * IOVECS_PER_REQUEST);
+    batch->headers = malloc(BATCH_HEADER_SIZE * batch_size);
+    batch->capacity = batch_size;
+    batch->count = 0;
+    batch->iov_sent = 0;
+    batch->bytes_pending = 0;
+    batch->flush_threshold = flush_threshold;
+    batch->file_fd = -1;
+    batch->file_base = NULL;
+    batch->file_size = 0;
+    batch->zerocopy = false;
+    batch->pinned = false;
+    batch->zerocopy_sent = 0;
+    batch->zerocopy_completed = 0;
+    batch->latency = NULL;
+    batch->stamped = 0;
+
+    if (batch->iov == NULL || batch->headers == NULL) {
+        log_error("Failed to allocate request batch\n");
+        tcp_client_batch_free(batch);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Lets the batch send large messages read by reader straight from its file with sendfile(),
+    provided the reader maps a file. Otherwise nothing changes.
+Arguments:
+    RequestBatch *batch: The batch
+    const RequestReader *reader: The reader the batch's requests come from
+Return value:
+    None
+*/
+void tcp_client_batch_use_file(RequestBatch *batch, const RequestReader *reader) {
+    // memory readers have no file to send from
+    if (!reader->mapped || reader->fd == -1) return;
+
+    batch->file_fd = reader->fd;
+    batch->file_base = reader->data;
+    batch->file_size = reader->size;
+}
+
+/*
+Description:
+    Checks if the batch can't take another request until it is flushed.
+Arguments:
+    RequestBatch *batch: The batch to check
+Return value:
+    Returns a true value if the batch is full, otherwise false
+*/
+int tcp_client_batch_full(RequestBatch *batch) {
+    return batch->count == batch->capacity || batch->bytes_pending >= batch->flush_threshold ||
+           batch->pinned;
+}
+
+/*
+Description:
+    Appends the iovecs for one request to the batch.
+Arguments:
+    RequestBatch *batch: The batch to add to
+    Action action: The action that will be sent
+    const char *message: The message that will be sent
+    size_t message_length: The length of message
+Return value:
+    Returns a true value if the batch is now full and should be flushed, otherwise false
+*/
+static int batch_push(RequestBatch *batch, Action action, const char *message,
+                      size_t message_length) {
+
+    char *header = batch->headers + batch->count * BATCH_HEADER_SIZE;
+    int header_length = snprintf(header, BATCH_HEADER_SIZE, "%zu ", message_length);
+    struct iovec *iov = batch->iov + batch->count * IOVECS_PER_REQUEST;
+    size_t action_length = ACTION_TOKENS[action].length;
+
+    iov[0].iov_base = (char *)ACTION_TOKENS[action].text;
+    iov[0].iov_len = action_length;
+    iov[1].iov_base = header;
+    iov[1].iov_len = header_length;
+    iov[2].iov_base = (char *)message;
+    iov[2].iov_len = message_length;
+
+    batch->bytes_pending += action_length + header_length + message_length;
+    batch->count++;
+
+    return tcp_client_batch_full(batch);
+}
+
+/*
+Description:
+    Frames a request read by a RequestReader into the batch without copying it. The batch does not
+    take ownership; the request must stay valid until the batch has been flushed. The batch must
+    not be full.
+Arguments:
+    RequestBatch *batch: The batch to add to
+    Request *request: The request that will be sent
+Return value:
+    Returns a true value if the batch is now full and should be flushed, otherwise false
+*/
+int tcp_client_batch_add_request(RequestBatch *batch, Request *request) {
+    return batch_push(batch, request->action, request->message, request->message_length);
+}
+
+/*
+Description:
+    Checks if an iovec is a message large enough to be worth sending straight from the batch's file.
+Arguments:
+    RequestBatch *batch: The batch
+    struct iovec *iov: The iovec to check
+Return value:
+    Returns a true value if the iovec should be sent with sendfile(), otherwise false
+*/
+static int batch_from_file(RequestBatch *batch, struct iovec *iov) {
+    const char *base = iov->iov_base;
+    return batch->file_base != NULL && iov->iov_len >= TCP_CLIENT_SENDFILE_THRESHOLD &&
+           base >= batch->file_base && base < batch->file_base + batch->file_size;
+}
+
+/*
+Description:
+    Writes iovecs of the batch with sendmsg() and MSG_ZEROCOPY starting at iov_sent, counting every
+    send the kernel will report a completion for. Where the kernel can't pin more memory it falls
+    back to a copying send.
+Arguments:
+    int sockfd: Socket file descriptor
+    RequestBatch *batch: The batch to send from
+    int iov_count: The index of the iovec to stop at
+Return value:
+    Returns the number of bytes written
+*/
+static size_t write_iovecs_zerocopy(int sockfd, RequestBatch *batch, int iov_count) {
+
+    size_t total_bytes_sent = 0;
+
+    while (batch->iov_sent < iov_count) {
+        struct msghdr message;
+        int remaining = iov_count - batch->iov_sent;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = batch->iov + batch->iov_sent;
+        message.msg_iovlen = remaining < IOV_MAX ? remaining : IOV_MAX;
+
+        ssize_t bytes_sent = sendmsg(sockfd, &message, MSG_ZEROCOPY);
+        STATS_ADD(syscalls, 1);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            if (errno == ENOBUFS) {
+                do {
+                    bytes_sent = sendmsg(sockfd, &message, 0);
+                    STATS_ADD(syscalls, 1);
+                } while (bytes_sent == -1 && errno == EINTR);
+                if (bytes_sent == -1) {
+                    // a full socket buffer just means later, anything else is a real failure
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                    log_error("Send failed!\n");
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                log_error("Send failed!\n");
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            batch->zerocopy_sent++;
+        }
+        stats_sent(bytes_sent);
         total_bytes_sent += bytes_sent;
+        advance_iovecs(batch->iov, iov_count, &batch->iov_sent, bytes_sent);
+    }
+    return total_bytes_sent;
+}
+
+/*
+Description:
+    Empties a batch whose requests have all been sent.
+Arguments:
+    RequestBatch *batch: The batch to empty
+Return value:
+    None
+*/
+static void batch_clear(RequestBatch *batch) {
+    batch->count = 0;
+    batch->iov_sent = 0;
+    batch->bytes_pending = 0;
+    batch->pinned = false;
+    batch->stamped = 0;
+}
+
+/*
+Description:
+    Counts requests that have been completely written since the last call, telling the batch's
+    latency tracker about them too.
+Arguments:
+    RequestBatch *batch: The batch
+Return value:
+    None
+*/
+static void batch_stamp(RequestBatch *batch) {
+    int sent = batch->iov_sent / IOVECS_PER_REQUEST;
+    if (sent == batch->stamped) return;
+
+    STATS_ADD(requests_sent, sent - batch->stamped);
+    if (batch->latency != NULL) latency_sent(batch->latency, sent - batch->stamped);
+    batch->stamped = sent;
+}
+
+/*
+Description:
+    Makes the batch send large writes with MSG_ZEROCOPY, if the socket supports it.
+Arguments:
+    RequestBatch *batch: The batch
+    int sockfd: The socket the batch is sent on
+Return value:
+    Returns a 1 if zerocopy sends aren't supported, 0 on success
+*/
+int tcp_client_batch_enable_zerocopy(RequestBatch *batch, int sockfd) {
+    int one = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1) return EXIT_FAILURE;
+    batch->zerocopy = true;
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Reads the zerocopy completions the kernel has queued on the socket's error queue and unpins the
+    batch once every zerocopy send from it has completed, emptying it.
+Arguments:
+    int sockfd: Socket file descriptor
+    RequestBatch *batch: The batch sent on the socket
+Return value:
+    Returns the number of completion notifications read
+*/
+int tcp_client_batch_reap(int sockfd, RequestBatch *batch) {
+
+    int reaped = 0;
+
+    while (1) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        if (recvmsg(sockfd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err *error = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+            // sends ee_info through ee_data have completed
+            batch->zerocopy_completed += error->ee_data - error->ee_info + 1;
+            if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                log_debug("Kernel copied a zerocopy send anyway\n");
+            }
+            reaped++;
+        }
+    }
+
+    if (batch->pinned && batch->zerocopy_completed == batch->zerocopy_sent) batch_clear(batch);
+    return reaped;
+}
+
+/*
+Description:
+    Writes the pending requests in the batch with writev(), and large messages from a file set with
+    tcp_client_batch_use_file() with sendfile(). On a blocking socket this returns once the whole
+    batch is sent; on a non-blocking socket it returns when the socket stops accepting data. The
+    batch is emptied once everything in it has been sent, or pinned if zerocopy sends from it
+    haven't completed yet.
+Arguments:
+    int sockfd: Socket file descriptor
+    RequestBatch *batch: The batch to send
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_batch_flush(int sockfd, RequestBatch *batch) {
+
+    int iov_count = batch->count * IOVECS_PER_REQUEST;
+
+    while (batch->iov_sent < iov_count) {
+        // write everything up to the next message that can come straight from the file
+        int next = batch->iov_sent;
+        while (next < iov_count && !batch_from_file(batch, &batch->iov[next])) next++;
+        if (next > batch->iov_sent) {
+            // pinning pages only pays off for large sends
+            if (batch->zerocopy && batch->bytes_pending >= TCP_CLIENT_ZEROCOPY_THRESHOLD) {
+                batch->bytes_pending -= write_iovecs_zerocopy(sockfd, batch, next);
+            } else {
+                batch->bytes_pending -= write_iovecs(sockfd, batch->iov, next, &batch->iov_sent);
+            }
+            if (batch->iov_sent < next) break;
+            continue;
+        }
+
+        struct iovec *message = &batch->iov[batch->iov_sent];
+        off_t offset = (const char *)message->iov_base - batch->file_base;
+        ssize_t bytes_sent = sendfile(sockfd, batch->file_fd, &offset, message->iov_len);
+        STATS_ADD(syscalls, 1);
+        if (bytes_sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            log_error("Send failed!\n");
+            exit(EXIT_FAILURE);
+        }
+        stats_sent(bytes_sent);
+        advance_iovecs(batch->iov, iov_count, &batch->iov_sent, bytes_sent);
+        batch->bytes_pending -= bytes_sent;
+    }
+
+    batch_stamp(batch);
+    if (batch->iov_sent == iov_count) {
+        // the kernel may still be reading our pages, so they can't be reused yet
+        if (batch->zerocopy_completed != batch->zerocopy_sent) {
+            batch->pinned = true;
+        } else {
+            batch_clear(batch);
+        }
     }
-    free(request);
     return EXIT_SUCCESS;
 }
 
+/*
+Description:
+    Gets the iovecs of the batch that have not been sent yet, for sending them some other way than
+    tcp_client_batch_flush(). At most IOV_MAX iovecs are handed out at once.
+Arguments:
+    RequestBatch *batch: The batch to send
+    int *iov_count: Set to the number of iovecs returned
+Return value:
+    Returns the first iovec not fully sent
+*/
+struct iovec *tcp_client_batch_unsent(RequestBatch *batch, int *iov_count) {
+    int remaining = batch->count * IOVECS_PER_REQUEST - batch->iov_sent;
+    *iov_count = remaining < IOV_MAX ? remaining : IOV_MAX;
+    return batch->iov + batch->iov_sent;
+}
+
+/*
+Description:
+    Records that bytes from tcp_client_batch_unsent() were sent. The batch is emptied once
+    everything in it has been sent.
+Arguments:
+    RequestBatch *batch: The batch that was sent from
+    size_t bytes_sent: The number of bytes sent
+Return value:
+    None
+*/
+void tcp_client_batch_sent(RequestBatch *batch, size_t bytes_sent) {
+    int iov_count = batch->count * IOVECS_PER_REQUEST;
+
+    advance_iovecs(batch->iov, iov_count, &batch->iov_sent, bytes_sent);
+    batch->bytes_pending -= bytes_sent;
+    stats_sent(bytes_sent);
+    batch_stamp(batch);
+    if (batch->iov_sent == iov_count) batch_clear(batch);
+}
+
+/*
+Description:
+    Releases the memory held by a batch.
+Arguments:
+    RequestBatch *batch: The batch to free
+Return value:
+    None
+*/
+void tcp_client_batch_free(RequestBatch *batch) {
+    free(batch->iov);
+    free(batch->headers);
+    batch->iov = NULL;
+    batch->headers = NULL;
+    batch->count = 0;
+}
+
+/*
+Description:
+    Prepares an empty response buffer. One byte past size is always allocated so a response can be
+    null terminated in place.
+Arguments:
+    ResponseBuffer *responses: The buffer to initialize
+    size_t size: The initial capacity in bytes
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_response_buffer_init(ResponseBuffer *responses, size_t size) {
+    memset(responses, 0, sizeof(ResponseBuffer));
+    responses->data = malloc(size + 1);
+    responses->size = size;
+    if (responses->data == NULL) {
+        log_error("Failed to allocate response buffer\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Makes sure needed bytes starting at the first unconsumed byte fit in the buffer, first by moving
+    the unconsumed bytes to the front and then by growing the buffer.
+Arguments:
+    ResponseBuffer *responses: The buffer to make room in
+    size_t needed: The number of bytes that must fit from start
+Return value:
+    Returns a 1 on failure (the buffer is left as it was), 0 on success
+*/
+static int response_buffer_reserve(ResponseBuffer *responses, size_t needed) {
+
+    if (responses->start > 0) {
+        memmove(responses->data, responses->data + responses->start,
+                responses->end - responses->start);
+        responses->end -= responses->start;
+        responses->start = 0;
+    }
+
+    if (needed > responses->size) {
+        size_t size = responses->size;
+        while (size < needed) {
+            // one byte more is allocated for the terminator, so stop well short of SIZE_MAX
+            if (size > (SIZE_MAX - 1) / 2) {
+                log_error("Response buffer can't grow to %zu bytes\n", needed);
+                return EXIT_FAILURE;
+            }
+            size *= 2;
+        }
+        char *data = realloc(responses->data, size + 1);
+        if (data == NULL) {
+            log_error("Failed to grow response buffer\n");
+            return EXIT_FAILURE;
+        }
+        responses->data = data;
+        responses->size = size;
+        STATS_ADD(buffer_grows, 1);
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Receives whatever is available on the socket into the end of the response buffer, making room
+    first if the tail of the buffer is full.
+Arguments:
+    int sockfd: Socket file descriptor
+    ResponseBuffer *responses: The buffer to receive into
+Return value:
+    Returns the number of bytes received, 0 if the connection is closed, -1 on error (errno is
+    ENOMEM if the buffer couldn't grow)
+*/
+int tcp_client_receive_into_buffer(int sockfd, ResponseBuffer *responses) {
+
+    if (responses->end == responses->size) {
+        size_t unconsumed = responses->end - responses->start;
+        size_t needed = unconsumed < responses->size ? responses->size : responses->size * 2;
+        if (response_buffer_reserve(responses, needed)) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    // the count comes back as an int
+    size_t room = responses->size - responses->end;
+    if (room > INT_MAX) room = INT_MAX;
+
+    int bytes_received = recv(sockfd, responses->data + responses->end, room, 0);
+    STATS_ADD(syscalls, 1);
+    if (bytes_received > 0) {
+        responses->end += bytes_received;
+        stats_received(bytes_received);
+    }
+    return bytes_received;
+}
+
+/*
+Description:
+    Copies bytes that were received some other way than tcp_client_receive_into_buffer() onto the
+    end of the response buffer, making room first if needed.
+Arguments:
+    ResponseBuffer *responses: The buffer to append to
+    const char *data: The received bytes
+    size_t length: The number of bytes in data
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_response_buffer_append(ResponseBuffer *responses, const char *data, size_t length) {
+    if (responses->end + length > responses->size &&
+        response_buffer_reserve(responses, responses->end - responses->start + length)) {
+        return EXIT_FAILURE;
+    }
+    memcpy(responses->data + responses->end, data, length);
+    responses->end += length;
+    stats_received(length);
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Does the work of tcp_client_parse_responses().
+Arguments:
+    ResponseBuffer *responses: The buffer holding received bytes
+    ResponseHandler handler: A callback function that handles a response
+    void *context: Passed through to handler unchanged
+    int *handled: Incremented for every response handled
+Return value:
+    Returns a true value if handler reported that all responses have been handled, false if more
+    are expected, or TCP_CLIENT_PARSE_FAILED on a protocol error or if the buffer couldn't grow
+*/
+static int parse_responses(ResponseBuffer *responses, ResponseHandler handler, void *context,
+                           int *handled) {
+
+    while (1) {
+        // pass on whatever has arrived of a response that is being streamed
+        if (responses->streaming) {
+            size_t available = responses->end - responses->start;
+            size_t piece = available < responses->stream_remaining ? available
+                                                                   : responses->stream_remaining;
+            if (piece > 0) {
+                responses->stream->chunk(responses->data + responses->start, piece, context);
+            }
+            responses->start += piece;
+            responses->stream_remaining -= piece;
+            if (responses->start == responses->end) responses->start = responses->end = 0;
+            if (responses->stream_remaining > 0) return false;
+
+            responses->streaming = false;
+            int all_done = responses->stream->end(context);
+            if (handled) (*handled)++;
+            if (all_done) return true;
+            continue;
+        }
+
+        // read the length prefix up to the first space char ' ', picking up where we left off
+        while (!responses->have_length) {
+            if (responses->start + responses->header_length == responses->end) return false;
+
+            char c = responses->data[responses->start + responses->header_length];
+            if (c == ' ' && responses->header_length > 0) {
+                responses->have_length = true;
+                break;
+            }
+            // the length is checked digit by digit, so it can't overflow before it is rejected
+            if (!isdigit(c) || responses->header_length == TCP_CLIENT_MAX_LENGTH_DIGITS) {
+                log_error("Malformed response length\n");
+                return TCP_CLIENT_PARSE_FAILED;
+            }
+            responses->message_length = responses->message_length * 10 + (c - '0');
+            responses->header_length++;
+            if (responses->message_length > TCP_CLIENT_MAX_RESPONSE_LENGTH) {
+                log_error("Response length is over %lu bytes\n", TCP_CLIENT_MAX_RESPONSE_LENGTH);
+                return TCP_CLIENT_PARSE_FAILED;
+            }
+        }
+
+        // too long to buffer whole, so hand it on as it arrives
+        if (responses->stream != NULL && responses->message_length > responses->stream->threshold) {
+            responses->stream->begin(responses->message_length, context);
+            responses->start += responses->header_length + 1;
+            responses->streaming = true;
+            responses->stream_remaining = responses->message_length;
+            responses->header_length = 0;
+            responses->message_length = 0;
+            responses->have_length = false;
+            continue;
+        }
+
+        size_t response_length = responses->header_length + 1 + responses->message_length;
+
+        // wait for the rest of the message, making sure it will fit when it comes
+        if (responses->end - responses->start < response_length) {
+            if (responses->start + response_length > responses->size &&
+                response_buffer_reserve(responses, response_length)) {
+                return TCP_CLIENT_PARSE_FAILED;
+            }
+            return false;
+        }
+
+        // buffer holds complete message
+        char *message = responses->data + responses->start + responses->header_length + 1;
+        char saved = message[responses->message_length];
+        message[responses->message_length] = '\0';
+        int all_done = handler(message, responses->message_length, context);
+        message[responses->message_length] = saved;
+        if (handled) (*handled)++;
+
+        responses->start += response_length;
+        responses->header_length = 0;
+        responses->message_length = 0;
+        responses->have_length = false;
+
+        // nothing left over, so the next recv can start at the front for free
+        if (responses->start == responses->end) responses->start = responses->end = 0;
+
+        if (all_done) return true;
+    }
+}
+
+/*
+Description:
+    Hands every complete "LENGTH MESSAGE" response in the buffer to the callback and consumes it.
+    The message is passed in place, null terminated by temporarily overwriting the byte after it,
+    so no memory is allocated per response. Responses longer than the threshold of the buffer's
+    stream handler are passed to it piece by piece instead, so the buffer never grows to hold them.
+    A length prefix that isn't a number of at most TCP_CLIENT_MAX_RESPONSE_LENGTH is a protocol
+    error. When stats are enabled, the time taken, handlers included, is counted in handle_ns.
+Arguments:
+    ResponseBuffer *responses: The buffer holding received bytes
+    ResponseHandler handler: A callback function that handles a response
+    void *context: Passed through to handler unchanged
+    int *handled: If not NULL, incremented for every response handled
+Return value:
+    Returns a true value if handler reported that all responses have been handled, false if more
+    are expected, or TCP_CLIENT_PARSE_FAILED on a protocol error or if the buffer couldn't grow
+*/
+int tcp_client_parse_responses(ResponseBuffer *responses, ResponseHandler handler, void *context,
+                               int *handled) {
+
+    struct timespec start, end;
+    int parsed = 0;
+
+    // nobody reads the time when stats aren't printed, so don't pay two clock reads for it
+    if (!stats_enabled) {
+        int all_done = parse_responses(responses, handler, context, &parsed);
+        STATS_ADD(responses_received, parsed);
+        if (handled) *handled += parsed;
+        return all_done;
+    }
+
+    // the handlers run inside the framing loop, so their time is counted along with it
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int all_done = parse_responses(responses, handler, context, &parsed);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    STATS_ADD(handle_ns, (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec);
+    STATS_ADD(responses_received, parsed);
+    if (handled) *handled += parsed;
+    return all_done;
+}
+
+/*
+Wraps a handler with the original null terminated string signature so it can be driven by
+tcp_client_receive_responses().
+*/
+typedef struct HandlerAdapter {
+    int (*handle_response)(char *);
+} HandlerAdapter;
+
+/*
+Description:
+    Forwards a response to the wrapped handler. tcp_client_parse_responses() null terminates the
+    data in place, so it can be passed on as a string.
+Arguments:
+    const char *data: The response
+    size_t length: The length of the response
+    void *context: The HandlerAdapter holding the wrapped handler
+Return value:
+    Returns the wrapped handler's return value
+*/
+static int adapt_handler(const char *data, size_t length, void *context) {
+    (void)length;
+    return ((HandlerAdapter *)context)->handle_response((char *)data);
+}
+
 /*
 Description:
     Receives the response from the server. The caller must provide a function pointer that handles
 the response and returns a true value if all responses have been handled, otherwise it returns a
     false value. After the response is handled by the handle_response function pointer, the response
     data can be safely deleted. The string passed to the function pointer must be null terminated.
+    This is an adapter over tcp_client_receive_responses() kept for compatibility.
 Arguments:
     int sockfd: Socket file descriptor
     int (*handle_response)(char *): A callback function that handles a response
@@ -228,26 +1198,58 @@ Return value:
     Returns a 1 on failure, 0 on success
 */
 int tcp_client_receive_response(int sockfd, int (*handle_response)(char *)) {
+    HandlerAdapter adapter = {handle_response};
+    return tcp_client_receive_responses(sockfd, &adapt_handler, NULL, NULL, &adapter);
+}
 
+/*
+Description:
+    Receives responses from the server and hands each one to handler as a pointer into the receive
+    buffer plus its length, so nothing is copied or allocated per response. handler returns a true
+    value once all responses have been handled, otherwise it returns a false value. The data is only
+    valid for the duration of the call (it is also null terminated there). While output holds
+    responses, each wait for more ends in time to write them out once they have waited its
+    interval.
+Arguments:
+    int sockfd: Socket file descriptor
+    ResponseHandler handler: A callback function that handles a response
+    const StreamHandler *stream: Handles responses too long to buffer, or NULL to buffer them all
+    OutputSink *output: The sink handler writes to, or NULL
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_receive_responses(int sockfd, ResponseHandler handler, const StreamHandler *stream,
+                                 OutputSink *output, void *context) {
 
-    int all_done = 0;
-    int total_bytes_received = 0;
+    ResponseBuffer responses;
     int bytes_received = 0;
-    char *buffer = malloc(DEFAULT_BUFFER_SIZE);
-    char char_message_length[10];
-    int buffer_size = DEFAULT_BUFFER_SIZE;
+
+    if (tcp_client_response_buffer_init(&responses, TCP_CLIENT_DEFAULT_BUFFER_SIZE)) {
+        return EXIT_FAILURE;
+    }
+    responses.stream = stream;
 
     // receive until all responses are received
     while (1) {
-
-        if (all_done) {
-            free(buffer);
-            return EXIT_SUCCESS;
+        // wake up for buffered output that has waited out its interval, even if nothing arrives
+        int timeout = output_timeout(output);
+        if (timeout >= 0) {
+            struct pollfd pfd = {sockfd, POLLIN, 0};
+            int ready = poll(&pfd, 1, timeout);
+            STATS_ADD(syscalls, 1);
+            if (ready == -1 && errno != EINTR) {
+                log_error("Poll failed!\n");
+                exit(EXIT_FAILURE);
+            }
+            if (output_expire(output)) {
+                free(responses.data);
+                return EXIT_FAILURE;
+            }
+            if (ready != 1) continue;
         }
 
-        //log_debug("Total Bytes Received: %ld", total_bytes_received);
-        
-        bytes_received = recv(sockfd, buffer + total_bytes_received, buffer_size - total_bytes_received, 0);
+        bytes_received = tcp_client_receive_into_buffer(sockfd, &responses);
         // check if an error has occurred
         if (bytes_received == -1) {
             log_error("Receive failed!\n");
@@ -258,48 +1260,216 @@ int tcp_client_receive_response(int sockfd, int (*handle_response)(char *)) {
             log_info("Connection closed.\n");
             break;
         }
-        total_bytes_received += bytes_received;
-        
-        while (1) {
-            // look for the first space char ' ' to find message length
-            char *first_space_addr = strchr(buffer,' ');
-            if (first_space_addr == NULL || !isdigit(buffer[0])) {
-                total_bytes_received = 0;
+        int all_done = tcp_client_parse_responses(&responses, handler, context, NULL);
+        if (all_done == TCP_CLIENT_PARSE_FAILED) {
+            free(responses.data);
+            return EXIT_FAILURE;
+        }
+        if (all_done) break;
+    }
+    free(responses.data);
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Switches the socket to non-blocking mode and sets up the batch and receive buffer that
+    tcp_client_duplex_run() uses on it.
+Arguments:
+    Duplex *duplex: The state to initialize
+    int sockfd: Socket file descriptor
+    Config config: A config struct with the necessary information.
+    const StreamHandler *stream: Handles responses too long to buffer, or NULL to buffer them all
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_duplex_init(Duplex *duplex, int sockfd, Config config,
+                           const StreamHandler *stream) {
+
+    duplex->sockfd = sockfd;
+    if (tcp_client_response_buffer_init(&duplex->responses, TCP_CLIENT_DEFAULT_BUFFER_SIZE)) {
+        return EXIT_FAILURE;
+    }
+    duplex->responses.stream = stream;
+    if (tcp_client_batch_init(&duplex->batch, config.batch_size, config.flush_threshold)) {
+        free(duplex->responses.data);
+        return EXIT_FAILURE;
+    }
+    duplex->batch.latency = config.latency;
+    if (config.zerocopy && tcp_client_batch_enable_zerocopy(&duplex->batch, sockfd)) {
+        log_info("Zerocopy sends aren't supported, copying instead\n");
+    }
+
+    if (fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        log_error("Failed to make socket non-blocking\n");
+        tcp_client_duplex_free(duplex);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Sends every request read from the reader while concurrently receiving responses, so the server's
+    responses never back up behind our own sends. The socket, and the input while it has nothing
+    ready, are driven with poll(), which also wakes up to write out config.output once it has
+    waited its interval. The return value of handler is ignored; the function returns once the
+    reader is exhausted and a response has been handled for every request sent, or the server
+    closes the connection. If config.window is non-zero, reading from the reader pauses while that
+    many requests are waiting for a response. The batch is empty again when it returns, so the
+    next run can reuse it.
+Arguments:
+    Duplex *duplex: State set up by tcp_client_duplex_init()
+    RequestReader *reader: The reader to read requests from
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_duplex_run(Duplex *duplex, RequestReader *reader, Config config,
+                          ResponseHandler handler, void *context) {
+
+    int sockfd = duplex->sockfd;
+    RequestBatch *batch = &duplex->batch;
+    int requests_sent = 0;
+    int responses_received = 0;
+    int end_of_file = 0;
+    int input_blocked = 0;
+    int status = EXIT_SUCCESS;
+    Request request;
+
+    tcp_client_batch_use_file(batch, reader);
+    // a pipe that goes quiet is waited on alongside the socket instead of blocking in read()
+    int input_fd = reader_set_nonblocking(reader);
+
+    while (!end_of_file || responses_received < requests_sent) {
+
+        // fill the batch while there is input left and room in the window
+        while (!end_of_file && !input_blocked && !tcp_client_batch_full(batch) &&
+               (config.window == 0 || requests_sent - responses_received < config.window)) {
+            int result = reader_next(reader, &request);
+            if (result == READER_WOULD_BLOCK) {
+                input_blocked = 1;
                 break;
             }
-            strncpy(char_message_length, buffer, first_space_addr - buffer);
-            char_message_length[first_space_addr - buffer] = '\0';
-
-            int message_length = atoi(char_message_length);
-            
-            // check if buffer is not big enough
-            if (message_length > (buffer_size - (first_space_addr - buffer) - 1)) {
-                buffer_size = buffer_size * 2;
-                buffer = realloc(buffer, buffer_size);
+            if (result == -1) {
+                end_of_file = 1;
                 break;
             }
+            tcp_client_batch_add_request(batch, &request);
+            requests_sent++;
+        }
+
+        // the file may have just run out with nothing left in flight
+        if (end_of_file && responses_received == requests_sent) break;
+
+        struct pollfd pfds[2] = {{sockfd, POLLIN, 0}, {input_fd, POLLIN, 0}};
+        struct pollfd *pfd = &pfds[0];
+        if (batch->count > 0 && !batch->pinned) pfd->events |= POLLOUT;
+
+        // wake up for buffered output that has waited out its interval, even if nothing arrives
+        int ready = poll(pfds, input_blocked ? 2 : 1, output_timeout(config.output));
+        STATS_ADD(syscalls, 1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            log_error("Poll failed!\n");
+            exit(EXIT_FAILURE);
+        }
+        if (output_expire(config.output)) {
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (input_blocked && pfds[1].revents) input_blocked = 0;
+
+        // zerocopy completions arrive on the error queue
+        int reaped = 0;
+        if ((pfd->revents & POLLERR) && batch->zerocopy) {
+            reaped = tcp_client_batch_reap(sockfd, batch);
+            if (batch->count == 0) reader_release(reader);
+        }
 
-            if (total_bytes_received < message_length) {
+        if (pfd->revents & POLLOUT) {
+            tcp_client_batch_flush(sockfd, batch);
+            // the batch no longer points into the reader once it has drained
+            if (batch->count == 0) reader_release(reader);
+        }
+
+        if ((pfd->revents & (POLLIN | POLLHUP)) || ((pfd->revents & POLLERR) && !reaped)) {
+            int bytes_received = tcp_client_receive_into_buffer(sockfd, &duplex->responses);
+            if (bytes_received == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
+                log_error("Receive failed!\n");
+                exit(EXIT_FAILURE);
+            }
+            // server is done with us, nothing more will arrive
+            if (bytes_received == 0) {
+                log_info("Connection closed.\n");
+                // the loop would have ended if nothing more were owed, so this run is cut short
+                log_error("Connection closed before every request was answered\n");
+                status = EXIT_FAILURE;
                 break;
             }
-
-            // buffer holds complete message
-            char *message = malloc(message_length + 1);
-            strncpy(message, first_space_addr + 1, message_length);
-            message[message_length] = '\0';
-            if(handle_response(message)) {
-                all_done = 1;
+            if (tcp_client_parse_responses(&duplex->responses, handler, context,
+                                           &responses_received) == TCP_CLIENT_PARSE_FAILED) {
+                status = EXIT_FAILURE;
                 break;
             }
-            int bytes_read = strlen(char_message_length) + message_length + 1;
-            memmove(buffer, buffer + bytes_read, buffer_size - bytes_read);
-            total_bytes_received -= bytes_read;
-            free(message);
         }
     }
-    return EXIT_SUCCESS;
+
+    // don't let go of what the kernel may still be sending from
+    while (batch->pinned) {
+        struct pollfd pfd = {sockfd, 0, 0};
+        if (poll(&pfd, 1, ZEROCOPY_DRAIN_TIMEOUT) <= 0 || !tcp_client_batch_reap(sockfd, batch)) {
+            break;
+        }
+    }
+    return status;
+}
+
+/*
+Description:
+    Releases the batch and receive buffer. The socket is left open.
+Arguments:
+    Duplex *duplex: The state to free
+Return value:
+    None
+*/
+void tcp_client_duplex_free(Duplex *duplex) {
+    tcp_client_batch_free(&duplex->batch);
+    free(duplex->responses.data);
+    duplex->responses.data = NULL;
 }
 
+/*
+Description:
+    Sends every request read from the reader while concurrently receiving responses, so the server's
+    responses never back up behind our own sends. The socket is switched to non-blocking mode and
+    driven with poll(). The return value of handler is ignored; the function returns once
+    the reader is exhausted and a response has been handled for every request sent, or the server
+    closes the connection. If config.window is non-zero, reading from the reader pauses while that
+    many requests are waiting for a response. Runs tcp_client_duplex_run() once on fresh state.
+Arguments:
+    int sockfd: Socket file descriptor
+    RequestReader *reader: The reader to read requests from
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    const StreamHandler *stream: Handles responses too long to buffer, or NULL to buffer them all
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_run_duplex(int sockfd, RequestReader *reader, Config config, ResponseHandler handler,
+                          const StreamHandler *stream, void *context) {
+
+    Duplex duplex;
+
+    if (tcp_client_duplex_init(&duplex, sockfd, config, stream)) return EXIT_FAILURE;
+    int status = tcp_client_duplex_run(&duplex, reader, config, handler, context);
+    tcp_client_duplex_free(&duplex);
+    return status;
+}
 
 /*
 Description:
@@ -335,14 +1505,13 @@ FILE *tcp_client_open_file(char *file_name) {
     }
 
     // check if file is empty
-    FILE *temp_file = fopen(file_name, "r");
-    fseek(temp_file, 0, SEEK_END);
-    if (ftell(temp_file) == 0) {
-        fclose(temp_file);
+    struct stat file_stat;
+    if (fstat(fileno(file), &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+        file_stat.st_size == 0) {
+        fclose(file);
         log_error("File is empty");
         exit(EXIT_FAILURE);
     }
-    fclose(temp_file);
 
     return file;
 }
@@ -351,63 +1520,13 @@ FILE *tcp_client_open_file(char *file_name) {
 Description:
     Checks if the action is valid.
 Arguments:
-    char *action: The char pointer to action
+    const char *action: The char pointer to action
+    size_t length: The length of action
 Return value:
-    Returns a 1 on failure, 0 on success
+    Returns a true value if the action is valid, otherwise false
 */
-int is_valid_action(char *action) {
-    // Will be nice to convert input action to lowercase
-    char *actions[NUMBER_OF_ACTIONS] = {"uppercase", "lowercase", "reverse", "shuffle", "random"};
-    // loop through 5 available actions
-    for (int i = 0; i < NUMBER_OF_ACTIONS; i++) {
-        // check if input action is a match to one of the available actions
-        if (!strcmp(action, actions[i])) return true;
-    }
-    // at end of the available action and still no match
-    return false;
-}
-
-/*
-Description:
-    Gets the next line of a file, filling in action and message. This function should be similar
-    design to getline() (https://linux.die.net/man/3/getline). *action and message must be allocated
-    by the function and freed by the caller.* When this function is called, action must point to the
-    action string and the message must point to the message string.
-Arguments:
-    FILE *fd: The file pointer to read from
-    char **action: A pointer to the action that was read in
-    char **message: A pointer to the message that was read in
-Return value:
-    Returns -1 on failure, the number of characters read on success
-*/
-int tcp_client_get_line(FILE *fd, char **action, char **message) {
-    
-    char *line = NULL;
-    size_t len = 0;
-    ssize_t read;
-   
-    // keep reading the next line unless there's an error
-    while ((read = getline(&line, &len, fd)) != -1) {
-        // skip empty line
-        if (!strcmp(line, "\n") || line[0] == ' ') continue;
-
-        // look for the first space char ' ' to split action and message
-        char *first_space_addr = strchr(line,' ');
-
-        // proceed if addr is not NULL
-        if (first_space_addr != NULL) {
-            *action = malloc(first_space_addr - line + 1);
-            *message = malloc(strlen(first_space_addr + 1));
-            sscanf(line, "%s %[^\n]", *action, *message);
-
-            // skip to next line if action is bad
-            if (!is_valid_action(*action)) continue;
-            break;
-        }
-    }
-    printf("here\n");
-    free(line);
-    return read;
+int is_valid_action(const char *action, size_t length) {
+    return action_lookup(action, length) != ACTION_INVALID;
 }
 
 /*
@@ -3,20 +3,40 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <linux/errqueue.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "latency.h"
+#include "output.h"
+#include "reader.h"
+
 #define TCP_CLIENT_BAD_SOCKET -1
 #define TCP_CLIENT_DEFAULT_PORT "8081"
 #define TCP_CLIENT_DEFAULT_HOST "localhost"
+#define TCP_CLIENT_DEFAULT_BUFFER_SIZE 1024
+#define TCP_CLIENT_DEFAULT_BATCH_SIZE 64
+#define TCP_CLIENT_DEFAULT_FLUSH_THRESHOLD 65536
+#define TCP_CLIENT_DEFAULT_STREAM_THRESHOLD 1048576
+#define TCP_CLIENT_SENDFILE_THRESHOLD 65536
+#define TCP_CLIENT_ZEROCOPY_THRESHOLD 16384
+#define TCP_CLIENT_MAX_RESPONSE_LENGTH (1UL << 30)
+#define TCP_CLIENT_MAX_LENGTH_DIGITS 19
+#define TCP_CLIENT_PARSE_FAILED -1
 
 /*
 Contains all of the information needed to create to connect to the server and send it a message.
@@ -25,8 +45,107 @@ typedef struct Config {
     char *port;
     char *host;
     char *file;
+    int duplex;
+    int window;
+    int batch_size;
+    int flush_threshold;
+    int connections;
+    int io_uring;
+    int threads;
+    int split;
+    long output_interval;
+    OutputSink *output;
+    size_t stream_threshold;
+    int zerocopy;
+    int latency_report;
+    LatencyTracker *latency;
+    long rate;
+    unsigned long requests;
+    long stats_interval;
 } Config;
 
+/*
+Handles one response. data points directly into the receive buffer and holds length bytes; context
+is the pointer given alongside the handler. Returns a true value once all responses have been
+handled, otherwise a false value.
+*/
+typedef int (*ResponseHandler)(const char *data, size_t length, void *context);
+
+/*
+Handles responses longer than threshold piece by piece as they arrive instead of whole, so they
+never have to fit in the receive buffer. begin gets the full length, chunk gets every piece of the
+message in order, and end returns what a ResponseHandler would. All three get the same context as
+the ResponseHandler they stand in for.
+*/
+typedef struct StreamHandler {
+    void (*begin)(size_t length, void *context);
+    void (*chunk)(const char *data, size_t length, void *context);
+    int (*end)(void *context);
+    size_t threshold;
+} StreamHandler;
+
+/*
+Holds response bytes that have been received from the server but not yet handed to the callback.
+Bytes in [start, end) are unconsumed; responses are handed out in place by advancing start, and
+bytes are only moved back to the front when the tail of the buffer runs out of room. The length
+prefix of the response at start is parsed once and remembered while the rest of it arrives. If
+stream is set, a response longer than its threshold is passed on as it arrives while streaming is
+set, with stream_remaining bytes of it still to come.
+*/
+typedef struct ResponseBuffer {
+    char *data;
+    size_t size;
+    size_t start;
+    size_t end;
+    size_t header_length;
+    size_t message_length;
+    int have_length;
+    const StreamHandler *stream;
+    int streaming;
+    size_t stream_remaining;
+} ResponseBuffer;
+
+/*
+Holds requests that have been framed but not yet written to the socket. Every request is three
+iovecs (the pre-rendered "ACTION " token, "LENGTH ", message) that point at static or caller bytes,
+so a whole batch goes out with one writev(). If the requests point into a mapped file, file_fd,
+file_base and file_size describe it, and messages of at least TCP_CLIENT_SENDFILE_THRESHOLD bytes are sent
+straight from the file with sendfile() instead. With zerocopy set, sends of at least
+TCP_CLIENT_ZEROCOPY_THRESHOLD bytes use MSG_ZEROCOPY: the kernel sends from our pages instead of a
+copy, so once everything is sent the batch stays pinned, unable to take requests, until the
+kernel reports that all of its zerocopy_sent sends have completed. If latency is set, it is told
+about every request as soon as the last of its bytes is written; stamped counts those requests.
+*/
+typedef struct RequestBatch {
+    struct iovec *iov;
+    char *headers;
+    int capacity;
+    int count;
+    int iov_sent;
+    size_t bytes_pending;
+    size_t flush_threshold;
+    int file_fd;
+    const char *file_base;
+    size_t file_size;
+    int zerocopy;
+    int pinned;
+    unsigned long zerocopy_sent;
+    unsigned long zerocopy_completed;
+    LatencyTracker *latency;
+    int stamped;
+} RequestBatch;
+
+/*
+A non-blocking connection with the batch and receive buffer that tcp_client_duplex_run() drives
+it with. Setting these up once and reusing them for every run on the connection keeps the cost of
+a run down to the requests themselves.
+*/
+typedef struct Duplex {
+    int sockfd;
+    RequestBatch batch;
+    ResponseBuffer responses;
+} Duplex;
+
 /*
 Description:
     Parses the commandline arguments and options given to the program.
@@ -55,15 +174,191 @@ int tcp_client_connect(Config config);
 
 /*
 Description:
-    Creates and sends request to server using the socket and configuration.
+    Starts connecting a non-blocking TCP socket to one resolved address. The connection finishes in
+    the background; the socket becomes writable once it has, and SO_ERROR tells whether it worked.
+Arguments:
+    struct addrinfo *address: The address to connect to
+Return value:
+    Returns the socket file descriptor or -1 if an error occurs.
+*/
+int tcp_client_start_connect(struct addrinfo *address);
+
+/*
+Description:
+    Prepares an empty request batch.
+Arguments:
+    RequestBatch *batch: The batch to initialize
+    int batch_size: The most requests the batch will hold before it must be flushed
+    int flush_threshold: The number of pending bytes at which the batch is considered full
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_batch_init(RequestBatch *batch, int batch_size, int flush_threshold);
+
+/*
+Description:
+    Frames a request read by a RequestReader into the batch without copying it. The batch does not
+    take ownership; the request must stay valid until the batch has been flushed. The batch must
+    not be full.
+Arguments:
+    RequestBatch *batch: The batch to add to
+    Request *request: The request that will be sent
+Return value:
+    Returns a true value if the batch is now full and should be flushed, otherwise false
+*/
+int tcp_client_batch_add_request(RequestBatch *batch, Request *request);
+
+/*
+Description:
+    Lets the batch send large messages read by reader straight from its file with sendfile(),
+    provided the reader maps a file. Otherwise nothing changes.
+Arguments:
+    RequestBatch *batch: The batch
+    const RequestReader *reader: The reader the batch's requests come from
+Return value:
+    None
+*/
+void tcp_client_batch_use_file(RequestBatch *batch, const RequestReader *reader);
+
+/*
+Description:
+    Makes the batch send large writes with MSG_ZEROCOPY, if the socket supports it.
+Arguments:
+    RequestBatch *batch: The batch
+    int sockfd: The socket the batch is sent on
+Return value:
+    Returns a 1 if zerocopy sends aren't supported, 0 on success
+*/
+int tcp_client_batch_enable_zerocopy(RequestBatch *batch, int sockfd);
+
+/*
+Description:
+    Reads the zerocopy completions the kernel has queued on the socket's error queue and unpins the
+    batch once every zerocopy send from it has completed, emptying it.
+Arguments:
+    int sockfd: Socket file descriptor
+    RequestBatch *batch: The batch sent on the socket
+Return value:
+    Returns the number of completion notifications read
+*/
+int tcp_client_batch_reap(int sockfd, RequestBatch *batch);
+
+/*
+Description:
+    Checks if the batch can't take another request until it is flushed.
+Arguments:
+    RequestBatch *batch: The batch to check
+Return value:
+    Returns a true value if the batch is full, otherwise false
+*/
+int tcp_client_batch_full(RequestBatch *batch);
+
+/*
+Description:
+    Writes the pending requests in the batch with writev(), and large messages from a file set with
+    tcp_client_batch_use_file() with sendfile(). On a blocking socket this returns once the whole
+    batch is sent; on a non-blocking socket it returns when the socket stops accepting data. The
+    batch is emptied once everything in it has been sent, or pinned if zerocopy sends from it
+    haven't completed yet.
+Arguments:
+    int sockfd: Socket file descriptor
+    RequestBatch *batch: The batch to send
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_batch_flush(int sockfd, RequestBatch *batch);
+
+/*
+Description:
+    Gets the iovecs of the batch that have not been sent yet, for sending them some other way than
+    tcp_client_batch_flush(). At most IOV_MAX iovecs are handed out at once.
+Arguments:
+    RequestBatch *batch: The batch to send
+    int *iov_count: Set to the number of iovecs returned
+Return value:
+    Returns the first iovec not fully sent
+*/
+struct iovec *tcp_client_batch_unsent(RequestBatch *batch, int *iov_count);
+
+/*
+Description:
+    Records that bytes from tcp_client_batch_unsent() were sent. The batch is emptied once
+    everything in it has been sent.
+Arguments:
+    RequestBatch *batch: The batch that was sent from
+    size_t bytes_sent: The number of bytes sent
+Return value:
+    None
+*/
+void tcp_client_batch_sent(RequestBatch *batch, size_t bytes_sent);
+
+/*
+Description:
+    Releases the memory held by a batch.
+Arguments:
+    RequestBatch *batch: The batch to free
+Return value:
+    None
+*/
+void tcp_client_batch_free(RequestBatch *batch);
+
+/*
+Description:
+    Prepares an empty response buffer. One byte past size is always allocated so a response can be
+    null terminated in place.
+Arguments:
+    ResponseBuffer *responses: The buffer to initialize
+    size_t size: The initial capacity in bytes
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_response_buffer_init(ResponseBuffer *responses, size_t size);
+
+/*
+Description:
+    Receives whatever is available on the socket into the end of the response buffer, making room
+    first if the tail of the buffer is full.
 Arguments:
     int sockfd: Socket file descriptor
-    char *action: The action that will be sent
-    char *message: The message that will be sent
+    ResponseBuffer *responses: The buffer to receive into
+Return value:
+    Returns the number of bytes received, 0 if the connection is closed, -1 on error (errno is
+    ENOMEM if the buffer couldn't grow)
+*/
+int tcp_client_receive_into_buffer(int sockfd, ResponseBuffer *responses);
+
+/*
+Description:
+    Copies bytes that were received some other way than tcp_client_receive_into_buffer() onto the
+    end of the response buffer, making room first if needed.
+Arguments:
+    ResponseBuffer *responses: The buffer to append to
+    const char *data: The received bytes
+    size_t length: The number of bytes in data
 Return value:
     Returns a 1 on failure, 0 on success
 */
-int tcp_client_send_request(int sockfd, char *action, char *message);
+int tcp_client_response_buffer_append(ResponseBuffer *responses, const char *data, size_t length);
+
+/*
+Description:
+    Hands every complete "LENGTH MESSAGE" response in the buffer to the callback and consumes it.
+    The message is passed in place, null terminated by temporarily overwriting the byte after it,
+    so no memory is allocated per response. Responses longer than the threshold of the buffer's
+    stream handler are passed to it piece by piece instead, so the buffer never grows to hold them.
+    A length prefix that isn't a number of at most TCP_CLIENT_MAX_RESPONSE_LENGTH is a protocol
+    error. When stats are enabled, the time taken, handlers included, is counted in handle_ns.
+Arguments:
+    ResponseBuffer *responses: The buffer holding received bytes
+    ResponseHandler handler: A callback function that handles a response
+    void *context: Passed through to handler unchanged
+    int *handled: If not NULL, incremented for every response handled
+Return value:
+    Returns a true value if handler reported that all responses have been handled, false if more
+    are expected, or TCP_CLIENT_PARSE_FAILED on a protocol error or if the buffer couldn't grow
+*/
+int tcp_client_parse_responses(ResponseBuffer *responses, ResponseHandler handler, void *context,
+                               int *handled);
 
 /*
 Description:
@@ -71,6 +366,7 @@ Description:
 the response and returns a true value if all responses have been handled, otherwise it returns a
     false value. After the response is handled by the handle_response function pointer, the response
     data can be safely deleted. The string passed to the function pointer must be null terminated.
+    This is an adapter over tcp_client_receive_responses() kept for compatibility.
 Arguments:
     int sockfd: Socket file descriptor
     int (*handle_response)(char *): A callback function that handles a response
@@ -79,6 +375,94 @@ Return value:
 */
 int tcp_client_receive_response(int sockfd, int (*handle_response)(char *));
 
+/*
+Description:
+    Receives responses from the server and hands each one to handler as a pointer into the receive
+    buffer plus its length, so nothing is copied or allocated per response. handler returns a true
+    value once all responses have been handled, otherwise it returns a false value. The data is only
+    valid for the duration of the call (it is also null terminated there). While output holds
+    responses, each wait for more ends in time to write them out once they have waited its
+    interval.
+Arguments:
+    int sockfd: Socket file descriptor
+    ResponseHandler handler: A callback function that handles a response
+    const StreamHandler *stream: Handles responses too long to buffer, or NULL to buffer them all
+    OutputSink *output: The sink handler writes to, or NULL
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_receive_responses(int sockfd, ResponseHandler handler, const StreamHandler *stream,
+                                 OutputSink *output, void *context);
+
+/*
+Description:
+    Switches the socket to non-blocking mode and sets up the batch and receive buffer that
+    tcp_client_duplex_run() uses on it.
+Arguments:
+    Duplex *duplex: The state to initialize
+    int sockfd: Socket file descriptor
+    Config config: A config struct with the necessary information.
+    const StreamHandler *stream: Handles responses too long to buffer, or NULL to buffer them all
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_duplex_init(Duplex *duplex, int sockfd, Config config,
+                           const StreamHandler *stream);
+
+/*
+Description:
+    Sends every request read from the reader while concurrently receiving responses, so the server's
+    responses never back up behind our own sends. The socket, and the input while it has nothing
+    ready, are driven with poll(), which also wakes up to write out config.output once it has
+    waited its interval. The return value of handler is ignored; the function returns once the
+    reader is exhausted and a response has been handled for every request sent, or the server
+    closes the connection. If config.window is non-zero, reading from the reader pauses while that
+    many requests are waiting for a response. The batch is empty again when it returns, so the
+    next run can reuse it.
+Arguments:
+    Duplex *duplex: State set up by tcp_client_duplex_init()
+    RequestReader *reader: The reader to read requests from
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_duplex_run(Duplex *duplex, RequestReader *reader, Config config,
+                          ResponseHandler handler, void *context);
+
+/*
+Description:
+    Releases the batch and receive buffer. The socket is left open.
+Arguments:
+    Duplex *duplex: The state to free
+Return value:
+    None
+*/
+void tcp_client_duplex_free(Duplex *duplex);
+
+/*
+Description:
+    Sends every request read from the reader while concurrently receiving responses, so the server's
+    responses never back up behind our own sends. The socket is switched to non-blocking mode and
+    driven with poll(). The return value of handler is ignored; the function returns once
+    the reader is exhausted and a response has been handled for every request sent, or the server
+    closes the connection. If config.window is non-zero, reading from the reader pauses while that
+    many requests are waiting for a response. Runs tcp_client_duplex_run() once on fresh state.
+Arguments:
+    int sockfd: Socket file descriptor
+    RequestReader *reader: The reader to read requests from
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    const StreamHandler *stream: Handles responses too long to buffer, or NULL to buffer them all
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int tcp_client_run_duplex(int sockfd, RequestReader *reader, Config config, ResponseHandler handler,
+                          const StreamHandler *stream, void *context);
+
 /*
 Description:
     Closes the given socket.
@@ -105,18 +489,14 @@ FILE *tcp_client_open_file(char *file_name);
 
 /*
 Description:
-    Gets the next line of a file, filling in action and message. This function should be similar
-    design to getline() (https://linux.die.net/man/3/getline). *action and message must be allocated
-    by the function and freed by the caller.* When this function is called, action must point to the
-    action string and the message must point to the message string.
+    Checks if the action is valid.
 Arguments:
-    FILE *fd: The file pointer to read from
-    char **action: A pointer to the action that was read in
-    char **message: A pointer to the message that was read in
+    const char *action: The char pointer to action
+    size_t length: The length of action
 Return value:
-    Returns -1 on failure, the number of characters read on success
+    Returns a true value if the action is valid, otherwise false
 */
-int tcp_client_get_line(FILE *fd, char **action, char **message);
+int is_valid_action(const char *action, size_t length);
 
 /*
 Description:
@@ -0,0 +1,580 @@
+#include "log.h"
+#include "stats.h"
+#include "uring.h"
+
+#if defined(__linux__) && !defined(TCP_CLIENT_NO_URING)
+#define URING_SUPPORTED 1
+#endif
+
+#ifdef URING_SUPPORTED
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_BUFFER_GROUP 0
+#define URING_SOCKET_INDEX 0
+#define URING_SEND_TAG 1
+#define URING_RECEIVE_TAG 2
+#define URING_CANCEL_TAG 3
+#define URING_INPUT_TAG 4
+
+/*
+The shared rings of one io_uring instance, driven with raw system calls, plus the ring of buffers
+the kernel picks from when a receive completes.
+*/
+typedef struct Uring {
+    int fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned sqe_tail;
+    unsigned to_submit;
+    struct io_uring_buf_ring *buffer_ring;
+    size_t buffer_ring_size;
+    char *buffers;
+} Uring;
+
+/*
+Description:
+    Unmaps and closes everything uring_init() set up. Safe to call on a partly initialized ring.
+Arguments:
+    Uring *ring: The ring to free
+Return value:
+    None
+*/
+static void uring_free(Uring *ring) {
+    if (ring->buffers != NULL) free(ring->buffers);
+    if (ring->buffer_ring != NULL) munmap(ring->buffer_ring, ring->buffer_ring_size);
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd != -1) close(ring->fd);
+}
+
+/*
+Description:
+    Hands a receive buffer (back) to the kernel.
+Arguments:
+    Uring *ring: The ring the buffer belongs to
+    unsigned short id: The buffer's index
+Return value:
+    None
+*/
+static void uring_provide_buffer(Uring *ring, unsigned short id) {
+    unsigned short tail = ring->buffer_ring->tail;
+    struct io_uring_buf *buffer = &ring->buffer_ring->bufs[tail & (URING_BUFFER_COUNT - 1)];
+
+    buffer->addr = (unsigned long)(ring->buffers + (size_t)id * URING_BUFFER_SIZE);
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = id;
+    __atomic_store_n(&ring->buffer_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+Description:
+    Creates an io_uring instance, maps its rings, registers the socket and registers the receive
+    buffers as a provided buffer ring.
+Arguments:
+    Uring *ring: The ring to initialize
+    int sockfd: The socket every request on the ring goes to
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int uring_init(Uring *ring, int sockfd) {
+
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(Uring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd == -1) return EXIT_FAILURE;
+    // waits are bounded by the output interval through io_uring_enter()'s extended argument
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        uring_free(ring);
+        return EXIT_FAILURE;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_free(ring);
+        return EXIT_FAILURE;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_free(ring);
+            return EXIT_FAILURE;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_free(ring);
+        return EXIT_FAILURE;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->sqe_tail = *ring->sq_tail;
+
+    // the socket is looked up once here instead of on every request
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, &sockfd, 1) == -1) {
+        uring_free(ring);
+        return EXIT_FAILURE;
+    }
+
+    // the buffer ring itself must be page aligned, so it gets its own mapping
+    ring->buffer_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    ring->buffer_ring = mmap(NULL, ring->buffer_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    if (ring->buffer_ring == MAP_FAILED || ring->buffers == NULL) {
+        if (ring->buffer_ring == MAP_FAILED) ring->buffer_ring = NULL;
+        uring_free(ring);
+        return EXIT_FAILURE;
+    }
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (unsigned long)ring->buffer_ring;
+    registration.ring_entries = URING_BUFFER_COUNT;
+    registration.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) ==
+        -1) {
+        uring_free(ring);
+        return EXIT_FAILURE;
+    }
+    for (unsigned short id = 0; id < URING_BUFFER_COUNT; id++) {
+        uring_provide_buffer(ring, id);
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+Description:
+    Gets a cleared submission queue entry to fill in. It is submitted by the next uring_enter().
+Arguments:
+    Uring *ring: The ring
+Return value:
+    Returns the entry
+*/
+static struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    // at most one send and one receive are ever queued, far fewer than URING_ENTRIES
+    unsigned index = ring->sqe_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+/*
+Description:
+    Submits the queued entries and waits for completions, all in one system call.
+Arguments:
+    Uring *ring: The ring
+    unsigned wait: The number of completions to wait for, 0 to only submit
+    int timeout: The most milliseconds to wait for them, or a negative value to wait as long as it
+        takes
+Return value:
+    Returns a 1 on failure, 0 on success, including when the wait timed out
+*/
+static int uring_enter(Uring *ring, unsigned wait, int timeout) {
+    struct __kernel_timespec ts = {timeout / 1000, (timeout % 1000) * 1000000L};
+    struct io_uring_getevents_arg arg;
+    unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+    void *extra = NULL;
+    size_t extra_size = 0;
+
+    if (wait > 0 && timeout >= 0) {
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (unsigned long)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        extra = &arg;
+        extra_size = sizeof(arg);
+    }
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    while (1) {
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait, flags,
+                                extra, extra_size);
+        STATS_ADD(syscalls, 1);
+        if (submitted == -1) {
+            if (errno == EINTR) continue;
+            // only reported when nothing was submitted, so there is nothing to account for
+            if (errno == ETIME) return EXIT_SUCCESS;
+            log_error("io_uring_enter failed!\n");
+            return EXIT_FAILURE;
+        }
+        ring->to_submit -= submitted;
+        return EXIT_SUCCESS;
+    }
+}
+
+/*
+Description:
+    Queues a multishot receive on the registered socket. It keeps completing, once per arrival of
+    data, into buffers from the provided buffer ring until the kernel stops it.
+Arguments:
+    Uring *ring: The ring
+Return value:
+    None
+*/
+static void uring_queue_receive(Uring *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = URING_SOCKET_INDEX;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_RECEIVE_TAG;
+}
+
+/*
+Description:
+    Queues a sendmsg() of the unsent part of a batch on the registered socket. message must stay
+    untouched until the send completes.
+Arguments:
+    Uring *ring: The ring
+    RequestBatch *batch: The batch to send
+    struct msghdr *message: Filled in to describe the batch
+Return value:
+    None
+*/
+static void uring_queue_send(Uring *ring, RequestBatch *batch, struct msghdr *message) {
+    int iov_count;
+
+    memset(message, 0, sizeof(struct msghdr));
+    message->msg_iov = tcp_client_batch_unsent(batch, &iov_count);
+    message->msg_iovlen = iov_count;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = URING_SOCKET_INDEX;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (unsigned long)message;
+    sqe->len = 1;
+    sqe->user_data = URING_SEND_TAG;
+}
+
+/*
+Description:
+    Queues a one-shot wait for the input to become readable, so a quiet pipe is waited on along
+    with the socket instead of blocking in read().
+Arguments:
+    Uring *ring: The ring
+    int fd: The input's file descriptor
+Return value:
+    None
+*/
+static void uring_queue_input(Uring *ring, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_INPUT_TAG;
+}
+
+/*
+Description:
+    Queues the cancellation of the request with the given tag. Its own completion is tagged
+    URING_CANCEL_TAG; the cancelled request still completes, usually with -ECANCELED.
+Arguments:
+    Uring *ring: The ring
+    unsigned long tag: The user_data of the request to cancel
+Return value:
+    None
+*/
+static void uring_queue_cancel(Uring *ring, unsigned long tag) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = tag;
+    sqe->user_data = URING_CANCEL_TAG;
+}
+
+/*
+Description:
+    Checks whether the receive that was just submitted was rejected outright, as kernels without
+    multishot receives reject it. Such a rejection completes during submission, before anything
+    could have been received, so the completion queue holds nothing else.
+Arguments:
+    Uring *ring: The ring
+Return value:
+    Returns a true value if the receive was rejected, otherwise false
+*/
+static int uring_receive_rejected(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    int rejected = false;
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        if (cqe->user_data == URING_RECEIVE_TAG && cqe->res == -EINVAL) rejected = true;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return rejected;
+}
+
+/*
+Description:
+    Cancels whatever is still in flight and waits until the kernel has reported the end of it, so
+    neither the batch's iovecs nor the receive buffers are freed while the kernel may still be
+    using them.
+Arguments:
+    Uring *ring: The ring
+    int *sending: A true value while a send is in flight, cleared once it completes
+    int *receiving: A true value while the receive is armed, cleared once it ends
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+static int uring_drain(Uring *ring, int *sending, int *receiving) {
+
+    if (*sending) uring_queue_cancel(ring, URING_SEND_TAG);
+    if (*receiving) uring_queue_cancel(ring, URING_RECEIVE_TAG);
+
+    while (*sending || *receiving) {
+        if (uring_enter(ring, 1, -1)) return EXIT_FAILURE;
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data == URING_SEND_TAG) *sending = 0;
+            if (cqe->user_data == URING_RECEIVE_TAG && !(cqe->flags & IORING_CQE_F_MORE)) {
+                *receiving = 0;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return EXIT_SUCCESS;
+}
+
+#endif
+
+/*
+Description:
+    Does the same job as tcp_client_run_duplex() through io_uring instead of poll(), send() and
+    recv(). The socket is registered with the ring, a single multishot receive stays armed for the
+    whole run and lands data in a ring of URING_BUFFER_COUNT registered buffers, and each batch goes
+    out as one sendmsg(), so one io_uring_enter() both submits the next batch and collects every
+    receive that completed meanwhile. Input with nothing ready is waited on with a poll request,
+    and each wait ends in time to write out config.output once it has waited its interval. If the
+    kernel doesn't support what's needed, or the client was built with TCP_CLIENT_NO_URING,
+    tcp_client_run_duplex() is used instead.
+Arguments:
+    int sockfd: Socket file descriptor
+    RequestReader *reader: The reader to read requests from
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    const StreamHandler *stream: Handles responses too long to buffer, or NULL to buffer them all
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int uring_run(int sockfd, RequestReader *reader, Config config, ResponseHandler handler,
+              const StreamHandler *stream, void *context) {
+
+#ifdef URING_SUPPORTED
+    Uring ring;
+    RequestBatch batch;
+    ResponseBuffer responses;
+    struct msghdr message;
+    int requests_sent = 0;
+    int responses_received = 0;
+    int end_of_file = 0;
+    int input_blocked = 0;
+    int sending = 0;
+    int receiving = 0;
+    int closed = 0;
+    int status = EXIT_SUCCESS;
+    Request request;
+
+    if (uring_init(&ring, sockfd)) {
+        log_info("io_uring is not available, falling back to poll()\n");
+        return tcp_client_run_duplex(sockfd, reader, config, handler, stream, context);
+    }
+
+    // kernels without multishot receives reject it as soon as it is submitted
+    uring_queue_receive(&ring);
+    if (uring_enter(&ring, 0, -1)) {
+        uring_free(&ring);
+        return EXIT_FAILURE;
+    }
+    if (uring_receive_rejected(&ring)) {
+        log_info("Multishot receives are not supported, falling back to poll()\n");
+        uring_free(&ring);
+        return tcp_client_run_duplex(sockfd, reader, config, handler, stream, context);
+    }
+    receiving = 1;
+
+    if (tcp_client_response_buffer_init(&responses, TCP_CLIENT_DEFAULT_BUFFER_SIZE)) {
+        uring_drain(&ring, &sending, &receiving);
+        uring_free(&ring);
+        return EXIT_FAILURE;
+    }
+    responses.stream = stream;
+    if (tcp_client_batch_init(&batch, config.batch_size, config.flush_threshold)) {
+        free(responses.data);
+        uring_drain(&ring, &sending, &receiving);
+        uring_free(&ring);
+        return EXIT_FAILURE;
+    }
+    batch.latency = config.latency;
+    int input_fd = reader_set_nonblocking(reader);
+
+    while (!closed && status == EXIT_SUCCESS) {
+
+        // the batch can't change while the kernel is sending from it, and whatever a partial send
+        // left behind goes out again even while the input has nothing more
+        if (!sending) {
+            while (!end_of_file && !input_blocked && !tcp_client_batch_full(&batch) &&
+                   (config.window == 0 || requests_sent - responses_received < config.window)) {
+                int result = reader_next(reader, &request);
+                if (result == READER_WOULD_BLOCK) {
+                    uring_queue_input(&ring, input_fd);
+                    input_blocked = 1;
+                    break;
+                }
+                if (result == -1) {
+                    end_of_file = 1;
+                    break;
+                }
+                tcp_client_batch_add_request(&batch, &request);
+                requests_sent++;
+            }
+            if (batch.count > 0) {
+                uring_queue_send(&ring, &batch, &message);
+                sending = 1;
+            }
+        }
+
+        if (end_of_file && !sending && responses_received == requests_sent) break;
+
+        // wake up for buffered output that has waited out its interval, even if nothing arrives
+        if (uring_enter(&ring, 1, output_timeout(config.output))) {
+            status = EXIT_FAILURE;
+            break;
+        }
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+            // whether the input is ready or the wait failed, the next read will tell
+            if (cqe->user_data == URING_INPUT_TAG) {
+                input_blocked = 0;
+                continue;
+            }
+
+            if (cqe->user_data == URING_SEND_TAG) {
+                sending = 0;
+                if (cqe->res < 0) {
+                    errno = -cqe->res;
+                    log_error("Send failed!\n");
+                    status = EXIT_FAILURE;
+                    continue;
+                }
+                tcp_client_batch_sent(&batch, cqe->res);
+                // the batch no longer points into the reader once it has drained
+                if (batch.count == 0) reader_release(reader);
+                continue;
+            }
+
+            if (cqe->res > 0) {
+                unsigned short id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                int failed = tcp_client_response_buffer_append(
+                    &responses, ring.buffers + (size_t)id * URING_BUFFER_SIZE, cqe->res);
+                uring_provide_buffer(&ring, id);
+                if (failed || tcp_client_parse_responses(&responses, handler, context,
+                                                         &responses_received) ==
+                                  TCP_CLIENT_PARSE_FAILED) {
+                    status = EXIT_FAILURE;
+                }
+            } else if (cqe->res == 0) {
+                // server is done with us, nothing more will arrive
+                log_info("Connection closed.\n");
+                closed = 1;
+                // a close can arrive along with the last response, which is fine
+                if (!end_of_file || responses_received < requests_sent) {
+                    log_error("Connection closed before every request was answered\n");
+                    status = EXIT_FAILURE;
+                }
+            } else if (cqe->res != -ENOBUFS) {
+                errno = -cqe->res;
+                log_error("Receive failed!\n");
+                status = EXIT_FAILURE;
+            }
+
+            // the kernel stops a multishot receive when it runs out of buffers, among other things
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                receiving = 0;
+                if (!closed && status == EXIT_SUCCESS) {
+                    uring_queue_receive(&ring);
+                    receiving = 1;
+                }
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        if (output_expire(config.output)) status = EXIT_FAILURE;
+    }
+
+    // the kernel may still be reading the batch or writing into the receive buffers
+    if (uring_drain(&ring, &sending, &receiving)) {
+        // can't tell whether it is done with them, so leave them be
+        log_error("Failed to wait for io_uring requests to finish\n");
+        free(responses.data);
+        return EXIT_FAILURE;
+    }
+    uring_free(&ring);
+    tcp_client_batch_free(&batch);
+    free(responses.data);
+    return status;
+#else
+    log_info("Built without io_uring, using poll()\n");
+    return tcp_client_run_duplex(sockfd, reader, config, handler, stream, context);
+#endif
+}
@@ -0,0 +1,34 @@
+#ifndef URING_H_
+#define URING_H_
+
+#include "reader.h"
+#include "tcp_client.h"
+
+#define URING_ENTRIES 64
+#define URING_BUFFER_COUNT 64
+#define URING_BUFFER_SIZE 16384
+
+/*
+Description:
+    Does the same job as tcp_client_run_duplex() through io_uring instead of poll(), send() and
+    recv(). The socket is registered with the ring, a single multishot receive stays armed for the
+    whole run and lands data in a ring of URING_BUFFER_COUNT registered buffers, and each batch goes
+    out as one sendmsg(), so one io_uring_enter() both submits the next batch and collects every
+    receive that completed meanwhile. Input with nothing ready is waited on with a poll request,
+    and each wait ends in time to write out config.output once it has waited its interval. If the
+    kernel doesn't support what's needed, or the client was built with TCP_CLIENT_NO_URING,
+    tcp_client_run_duplex() is used instead.
+Arguments:
+    int sockfd: Socket file descriptor
+    RequestReader *reader: The reader to read requests from
+    Config config: A config struct with the necessary information.
+    ResponseHandler handler: A callback function that handles a response
+    const StreamHandler *stream: Handles responses too long to buffer, or NULL to buffer them all
+    void *context: Passed through to handler unchanged
+Return value:
+    Returns a 1 on failure, 0 on success
+*/
+int uring_run(int sockfd, RequestReader *reader, Config config, ResponseHandler handler,
+              const StreamHandler *stream, void *context);
+
+#endif